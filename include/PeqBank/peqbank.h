@@ -68,17 +68,28 @@
 #define PI2 9.86960440108936f     // PI squared
 #define TWOPI 6.28318530717959f   // 2 * PI
 #define SMALL 0.000001
+#define FLAT_TOLERANCE 0.00001f  // Max coefficient deviation of a section treated as a wire
+#define SILENCE_THRESHOLD 1e-8f  // Default state magnitude below which a silent tail is over
+#define LIMIT_THRESHOLD_DB -0.5f  // Default limiter threshold in dBFS
+#define LIMIT_RELEASE_MS 50.0f    // Default limiter release time
 #define NBCOEFF 5
 #define FAST 1
 #define SMOOTH 0
 #define USESHELF 0
 #define NOSHELF NBCOEFF
 #define MAXELEM 16
+#define MAXEVENTS 32
+#define SVF_SUBBLOCK 4         // Frames between parameter updates of ramping SVF sections
+#define DYNAMIC_CONTROL 32     // Default control period of dynamic bands, in frames
+#define DYNAMIC_STEP_DB 0.05f  // Gain change below which a dynamic band is not redesigned
 #define MINORDER 2
 #define MAXORDER (MAXELEM * 2)
 
 enum { LOWPASS, HIGHPASS };
-enum { LPHP, SHELF, PEQ, NONE };
+enum { LPHP, SHELF, PEQ, DYNAMIC, NONE };
+enum { NOSKIP, SKIP_SILENT, SKIP_FLAT };
+enum { LIMIT_OFF, LIMIT_SOFT, LIMIT_LOOKAHEAD };
+enum { TOPOLOGY_DF, TOPOLOGY_SVF };
 
 typedef struct _filter {
   int type;
@@ -108,49 +119,235 @@ typedef struct _lphp {
   int type;      // LOWPASS (0) or HIGHPASS (1)
 } t_lphp;
 
+// Peaking band whose gain follows the level of the input in the band, like a compressor (range < 0)
+// or an expander (range > 0) restricted to that band. The callbacks run the sidechain and redesign
+// this one section every control period (peqbank_set_control_rate).
+typedef struct _dynamic {
+  float freq;       // Center frequency in Hz, of the band and of its bandpass sidechain
+  float bandwidth;  // Bandwidth in octaves
+  float gain;       // Static gain at the center in dB
+  float threshold;  // Sidechain level in dBFS above which the gain moves
+  float ratio;      // Above threshold, the gain moves by (1 - 1 / ratio) dB per dB
+  float range;      // Largest gain change in dB: negative cuts, positive boosts
+  float attack;     // Envelope attack time in ms
+  float release;    // Envelope release time in ms
+} t_dynamic;
+
+// Runtime state of a dynamic band, kept by the bank so that several banks can share a filter list
+typedef struct _dynamic_state {
+  float fs;             // Sampling rate the sidechain coefficients were computed for, 0 to redo
+  float sc[NBCOEFF];    // Sidechain bandpass biquad
+  float sc_state[4];    // Its x[n-1], x[n-2], y[n-1], y[n-2]
+  float attack_coeff;   // Per-sample envelope coefficient while rising
+  float release_coeff;  // Per-sample envelope coefficient while falling
+  float env;            // Sidechain envelope, linear
+  float gain_dynamic;   // Gain change designed into the section in dB
+} t_dynamic_state;
+
+// A filter change scheduled at a frame of an upcoming block
+typedef struct _peqbank_event {
+  int offset;          // Frames from the start of the next block
+  t_filter **filters;  // Installed with peqbank_compute at that frame
+} t_peqbank_event;
+
+// Coefficients designed ahead of time for one sampling rate
+typedef struct _peqbank_rate {
+  int rate;        // Sampling rate in Hz
+  int nbiquads;    // Number of biquads, after optimization
+  int ndesigned;   // Number of biquads before optimization
+  int flat;        // Set when the cascade is a unity-gain wire
+  int optimized;   // Set when the optimizer removed sections
+  float headroom;  // Headroom of the design in dB, see peqbank_get_headroom
+  float *coeff;    // b_max * NBCOEFF * b_channels coefficients, in the layout of coeff
+} t_peqbank_rate;
+
+typedef struct _peqbank_stats {
+  uint64_t samples;           // Frames processed (per channel)
+  uint64_t blocks;            // Callbacks processed
+  uint64_t skipped_blocks;    // Callbacks that bypassed the cascade (silence or flat bank)
+  int64_t total_ns;           // Cumulative time spent in callbacks
+  int64_t max_ns;             // Longest callback
+  uint64_t coeff_swaps;       // New coefficient sets swapped in
+  uint64_t swap_errors;       // Coefficient pointers found in an unexpected state
+  uint64_t denormal_flushes;  // Filter state values flushed to zero
+  uint64_t clip_events;       // Output samples beyond full scale after the limiter
+  uint64_t limit_events;      // Output samples whose level the limiter reduced
+  uint64_t section_updates;   // Dynamic band sections redesigned in place
+} t_peqbank_stats;
+
+// Output level of one channel, accumulated while the callbacks store their output
+typedef struct _peqbank_meter {
+  float peak;          // Largest absolute output sample
+  float rms;           // Root mean square of the output, filled in by peqbank_get_meters
+  double sum_squares;  // Sum of the squared output samples
+  uint64_t clips;      // Output samples beyond full scale after the limiter, before saturation
+  uint64_t frames;     // Frames accumulated
+} t_peqbank_meter;
+
 typedef struct _peqbank {
-  t_filter **filters;  // Ptr on list of filters (e.g. shelf, peq, lowpass, highpass)
+  t_filter **filters;       // Ptr on list of filters (e.g. shelf, peq, lowpass, highpass)
+  t_filter ***b_chfilters;  // One list per channel (peqbank_setup_channels), NULL when shared
+  float *b_chdesign;        // Per-channel designs before interleaving, b_max * NBCOEFF each
 
-  float *coeff;     // Pointers for smoothly interpolating between biquad coefficients
-  float *oldcoeff;  // There are 5 coeffs per biquad. There can be multiple biquads per filter.
+  // Pointers for smoothly interpolating between biquad coefficients. There are 5 coeffs per biquad.
+  // There can be multiple biquads per filter. With per-channel filters, the coefficients are stored
+  // [biquad][coeff][channel], shorter cascades being padded with identity biquads.
+  float *coeff;
+  float *oldcoeff;
   float *newcoeff;
   float *freecoeff;
+  uint64_t b_generation;  // Bumped whenever coeff changes, by a swap or in place; never reset
+
+  float b_Fs;       // Sample rate
+  int b_channels;   // Number of audio channels to process in parallel
+  int b_max;        // Max number of biquads (used to allocate memory)
+  int b_nbiquads;   // Actual number of biquads
+  int b_ndesigned;  // Number of biquads before the optimization pass
+  int b_optimized;  // Set when the optimizer removed sections, which then no longer follow filters
+
+  int b_nrates;                 // Number of precomputed coefficient sets
+  t_peqbank_rate *b_rate_sets;  // Sets designed by peqbank_precompute_rates
+
+  float b_opt_tolerance;  // Max distance to identity/cancellation of dropped sections, 0 disables
+  float b_opt_max_error;  // Max response error in dB when pruning further sections, 0 disables
+  int b_flat;             // Set when the active cascade is a unity-gain wire
+  int b_headroom_auto;    // Set when designs are scaled down to a peak gain of 0 dB
+  float b_headroom;       // Attenuation in dB applied to the last design
+
+  float b_silence_thresh;  // Silent channels settle once all states fall below this, 0 disables
+  int *b_settled;          // Per channel: state has decayed and the input tail is over
+  int b_skipped;           // NOSKIP, SKIP_SILENT or SKIP_FLAT for the last processed block
+
+  int b_ramp;                           // SMOOTH mode ramp length in frames, 0 for one buffer
+  int b_ramp_left;                      // Frames left in the ramp in progress
+  uint64_t b_ramp_swap;                 // b_generation when the ramp in progress started
+  int b_block;                          // Callback length while perform_range splits it, else 0
+  int b_nevents;                        // Number of pending events
+  t_peqbank_event b_events[MAXEVENTS];  // Pending events, sorted by offset
+  int b_dynamic;                        // Number of dynamic bands in the active filters
+  int b_control;                        // Control period of the dynamic bands in frames
+  int b_control_left;                   // Frames until their next update
+  t_dynamic_state *b_dynamic_state;     // Per list and filter position, MAXELEM per channel
 
-  float b_Fs;      // Sample rate
-  int b_channels;  // Number of audio channels to process in parallel
-  int b_max;       // Max number of biquads (used to allocate memory)
-  int b_nbiquads;  // Actual number of biquads
+  float *b_fade_coeff;       // Coefficients of the cascade being faded out after a topology change
+  int b_fade_nbiquads;       // Number of biquads of that cascade
+  int b_fade_per_channel;    // Set when b_fade_coeff has the per-channel layout
+  float *b_fade_state;       // Its xm1, xm2, ym1 and ym2, b_max * b_channels values each
+  int b_fade_len;            // Length of the crossfade in progress
+  int b_fade_left;           // Frames left in the crossfade in progress, 0 when none
+  t_filter **b_defer_filters;// Filters set during that crossfade, installed at its end
+  int b_deferred;            // Set when a change waits for the crossfade to end
+  float **s_vec_fade;        // Output of the cascade being faded out
+
+  int b_limit;             // LIMIT_OFF, LIMIT_SOFT or LIMIT_LOOKAHEAD, applied on output
+  float b_limit_thresh;    // Linear level where the soft curve and gain reduction start
+  float b_limit_inv;       // 1 / (1 - b_limit_thresh)
+  float b_limit_release;   // Per-sample release coefficient of the look-ahead gain
+  int b_lookahead;         // Look-ahead (and latency) in frames
+  float *b_limit_delay;    // Look-ahead delay line, interleaved, b_lookahead frames
+  int b_limit_pos;         // Write position in the delay line
+  int b_limit_hold;        // Frames until the current peak has left the delay line
+  float b_limit_gain;      // Current look-ahead gain
+  float b_limit_target;    // Gain required by the strictest peak in flight
+  float b_limit_next;      // Gain required by the strictest peak behind it
+  float b_limit_step;      // Per-sample slope of the gain ramp towards b_limit_target
 
   int b_mode;         // SMOOTH (0) or FAST (1)
+  int b_topology;     // TOPOLOGY_DF or TOPOLOGY_SVF: how the sections are run
   float *b_ym1;       // Ptr on y minus 1 per biquad, per channel
   float *b_ym2;       // Ptr on y minus 2 per biquad, per channel
-  float *b_xm1;       // Ptr on x minus 1 per biquad, per channel
-  float *b_xm2;       // Ptr on x minus 2 per biquad, per channel
+  float *b_xm1;       // Ptr on x minus 1 per biquad, per channel (SVF: first integrator)
+  float *b_xm2;       // Ptr on x minus 2 per biquad, per channel (SVF: second integrator)
   float **s_vec_in;   // Input buffers
   float **s_vec_out;  // Output buffers
   float **s_vec_bak;  // Pointer to memory alocated for output buffer if in-place filtering happens
   int s_n;            // Size buffer
 
+  t_peqbank_stats stats;      // Counters, updated without any I/O on the audio path
+  int b_meter;                // Set when the callbacks meter their output
+  t_peqbank_meter *b_meters;  // Per channel levels since the last reset
+
 } t_peqbank;
 
 float peqbank_pow10(float x);
 float peqbank_pow2(float x);
+int64_t peqbank_clock_ns(void);  // Monotonic clock, for timing only
 void peqbank_allocmem(t_peqbank *x);
 void peqbank_resize_buffer(t_peqbank *x, int buffer_size);
 void peqbank_freemem(t_peqbank *x);
-void peqbank_clear(t_peqbank *x);
+void peqbank_free(t_peqbank *x);
+void peqbank_clear(t_peqbank *x);  // Puts the cascade and the limiter at rest
 void peqbank_init(t_peqbank *x);
 t_peqbank *peqbank_new(int sampling_rate, int num_channels, int buffer_size);
 void peqbank_print_info(t_peqbank *x);
 int do_peqbank_perform_fast(t_peqbank *x);
 int peqbank_perform_fast(t_peqbank *x);
 int peqbank_perform_smooth(t_peqbank *x);
+int peqbank_perform(t_peqbank *x);
+void peqbank_set_silence_threshold(t_peqbank *x, float threshold);
+// Sample-accurate automation: installs filters at frame offset of the next block (later offsets
+// carry over to the following blocks). Processing is split at that frame and, in SMOOTH mode, the
+// coefficients ramp over peqbank_set_ramp frames from there, across block boundaries if needed.
+// Call from the thread running the callbacks. Returns -1 if MAXEVENTS events are already pending.
+int peqbank_post_event(t_peqbank *x, int offset, t_filter **filters);
+// Installs filters without resetting the bank. Same section count: same as peqbank_compute. In
+// SMOOTH mode, a change of section count (a filter added or removed, another lowpass order) runs
+// the old and new cascades side by side and crossfades their outputs over the ramp length, then
+// drops the old one. Changes made during a crossfade, by this call or another, take effect at its
+// end. Call from the thread running the callbacks.
+void peqbank_set_filters(t_peqbank *x, t_filter **filters);
+// Copies the coefficients of one channel into coeff (b_max * NBCOEFF values), in the layout of a
+// shared bank, and returns the number of biquads
+int peqbank_channel_coeffs(t_peqbank *x, int channel, float *coeff);
+void peqbank_set_ramp(t_peqbank *x, int frames);
+// Runs the sections as direct-form biquads (TOPOLOGY_DF, the default) or as trapezoidal
+// state-variable filters (TOPOLOGY_SVF). The filters are designed the same way and converted, so
+// both have the same response. SVF sections ramp their cutoff, damping and mixing parameters every
+// SVF_SUBBLOCK frames instead of five coefficients every frame, and remain stable at any point of
+// a ramp, which suits fast sweeps. The state of one topology does not carry over to the other:
+// switching clears it.
+void peqbank_set_topology(t_peqbank *x, int topology);
+// Sets how often dynamic bands update their section, in frames (DYNAMIC_CONTROL by default).
+// Processing is split at these updates, so shorter periods cost more calls to the kernel.
+void peqbank_set_control_rate(t_peqbank *x, int frames);
+// Switches to another sampling rate in place, keeping the filter state: redesigns the filters,
+// or copies the coefficients precomputed for that rate. In SMOOTH mode the change is ramped like
+// any other. The limiter release is rescaled; its look-ahead keeps its length in frames. Returns
+// -1, leaving the bank untouched, if sampling_rate is not positive.
+int peqbank_set_sample_rate(t_peqbank *x, int sampling_rate);
+// Designs the current filters for each of the rates ahead of time, e.g. at setup, so that a later
+// switch to one of them does no design work. Changing the filters drops these sets. Returns -1 if
+// out of memory.
+int peqbank_precompute_rates(t_peqbank *x, const int *rates, int num_rates);
+// Drops the sets of peqbank_precompute_rates. The optimizer and headroom setters call it, since
+// the sets were designed with the previous settings. The limiter does not change the designs.
+void peqbank_free_rate_sets(t_peqbank *x);
+int peqbank_is_flat(const float *coeff, int nbiquads);
+// Copies the counters into stats (may be NULL) and optionally resets them. Not synchronized: call
+// it from the thread running the callbacks, or while no callback is running.
+void peqbank_get_stats(t_peqbank *x, t_peqbank_stats *stats, int reset);
+// Enables or disables output metering. The callbacks then accumulate the peak, sum of squares and
+// clip count of each channel as they write their output, with no extra pass over the buffer.
+void peqbank_set_metering(t_peqbank *x, int enabled);
+// Copies the levels of the b_channels channels into meters and optionally resets them. Same
+// threading rules as peqbank_get_stats.
+void peqbank_get_meters(t_peqbank *x, t_peqbank_meter *meters, int reset);
 int16_t sampleLimiter(int samp);
+void peqbank_set_limiter(
+    t_peqbank *x, int mode, float threshold_db, float lookahead_ms, float release_ms);
+void peqbank_limiter_clear(t_peqbank *x);
+int peqbank_limiter_latency(t_peqbank *x);
 int peqbank_callback_int16(t_peqbank *x, int16_t *sig_input, int16_t *sig_output);
 int peqbank_callback_float(t_peqbank *x, float *sig_input, float *sig_output);
 void compute_shelf(t_peqbank *x, t_shelf *s, int index);
 void compute_peq(t_peqbank *x, t_peq *p, int index);
 void compute_lphp(t_peqbank *x, t_lphp *f, int index);
+// Same designs into coeff: NBCOEFF values, order / 2 sections of them for a lowpass or highpass
+void compute_shelf_coeffs(t_peqbank *x, const t_shelf *s, float *coeff);
+void compute_peq_coeffs(t_peqbank *x, const t_peq *p, float *coeff);
+void compute_lphp_coeffs(t_peqbank *x, const t_lphp *f, float *coeff);
+// Designs the section of a dynamic band, moved by gain_dynamic dB, into coeff (NBCOEFF values)
+void compute_dynamic(t_peqbank *x, const t_dynamic *d, float gain_dynamic, float *coeff);
 void swap_in_new_coeffs(t_peqbank *x);
 void peqbank_compute(t_peqbank *x);
 void peqbank_reset(t_peqbank *x);
@@ -161,8 +358,115 @@ t_filter *new_peq(
 t_filter *new_lphp(float freq, float ripple, int order);
 t_filter *new_lowpass(float freq, float ripple, int order);
 t_filter *new_highpass(float freq, float ripple, int order);
+t_filter *new_dynamic(float freq,
+                      float bandwidth,
+                      float gain,
+                      float threshold,
+                      float ratio,
+                      float range,
+                      float attack_ms,
+                      float release_ms);
 t_filter **new_filters(int num_filters);
+// Builds a filter list from a spec such as "highpass:500,0.5,8;peq:3000,0.5,-3,12,3". Each entry
+// takes the arguments of the matching constructor: lowpass/highpass (freq, ripple, order),
+// shelf (gain_low, gain_middle, gain_high, freq_low, freq_high), peq (freq_peak, bandwidth,
+// gain_dc, gain_peak, gain_bandwidth) and dynamic (freq, bandwidth, gain, threshold, ratio, range,
+// attack_ms, release_ms). Returns NULL if the spec is malformed or its filters need more than
+// MAXELEM biquad sections (order / 2 per lowpass or highpass, one per other filter).
+t_filter **new_filters_from_spec(const char *spec);
 void free_filters(t_filter **filters);
+// Filters that do not fit in the b_max sections, and those after them, are left out of the design
 void peqbank_setup(t_peqbank *x, t_filter **filters);
+// Sets up a different filter list for each channel: filters[c] for channel c. All channels still
+// run in the same pass. peqbank_compute redesigns every list.
+void peqbank_setup_channels(t_peqbank *x, t_filter ***filters);
+
+// Response of the active cascade at num_freqs frequencies (Hz): magnitude in dB, phase in radians
+// and group delay in samples. Any of the output arrays may be NULL. With per-channel filters, this
+// is the response of channel 0; see peqbank_channel_coeffs for the others.
+void peqbank_response(t_peqbank *x,
+                      const float *freqs,
+                      int num_freqs,
+                      float *mag_db,
+                      float *phase,
+                      float *group_delay);
+void peqbank_response_coeffs(const float *coeff,
+                             int nbiquads,
+                             float sampling_rate,
+                             const float *freqs,
+                             int num_freqs,
+                             float *mag_db,
+                             float *phase,
+                             float *group_delay);
+
+// Number of frames after which the response of the active cascade to any past input stays below
+// eps, i.e. how long it takes to rebuild the filter state from silence to within eps. Derived
+// from the section poles. Returns -1 if a pole lies on or outside the unit circle. With per-channel
+// filters, the longest over all channels.
+int peqbank_decay_length(t_peqbank *x, float eps);
+int peqbank_decay_length_coeffs(const float *coeff, int nbiquads, float eps);
+// Highest magnitude in dB of a cascade between DC and the Nyquist frequency: the maximum over a
+// log-spaced grid, refined around the highest grid point.
+float peqbank_peak_gain_coeffs(const float *coeff, int nbiquads, float sampling_rate);
+
+// Snapshot of the processing state: filter state, coefficients and SMOOTH ramp in progress,
+// crossfade, limiter and dynamic band state, in native byte order. It restores into a bank with the
+// same sampling rate, channel count, per-channel layout, section topology and limiter look-ahead,
+// normally set up with the same filters. Pending events are not part of it. Call from the thread
+// running the callbacks.
+#define PEQBANK_STATE_VERSION 3
+size_t peqbank_state_size(t_peqbank *x);
+// Returns the number of bytes written, or -1 if size is too small
+int peqbank_save_state(t_peqbank *x, void *buf, size_t size);
+// Returns -1, leaving the bank untouched, if the snapshot is malformed or does not fit this bank
+int peqbank_load_state(t_peqbank *x, const void *buf, size_t size);
+
+// Optional pass run by peqbank_compute: drops near-identity sections, cancels matching pole/zero
+// pairs, folds the removed gain into the first section and, when max_error_db > 0, prunes further
+// sections as long as the response stays within max_error_db of the designed cascade, from 2 Hz
+// up so that subsonic highpasses are kept. Sections removed by one design may be kept by the
+// next, so in SMOOTH mode a new design crossfades from the running cascade when either of them was
+// optimized, instead of ramping their sections.
+void peqbank_set_optimize(t_peqbank *x, float tolerance, float max_error_db);
+
+// Limits of the bands fitted by peqbank_fit
+typedef struct _fit_limits {
+  float freq_min;       // Lowest PEQ center and shelf corner in Hz
+  float freq_max;       // Highest PEQ center and shelf corner in Hz, kept below FIT_NYQUIST_RATIO
+  float gain_max;       // Largest gain of a band in dB, cut or boost
+  float bandwidth_min;  // Narrowest PEQ band in octaves
+  float bandwidth_max;  // Widest PEQ band in octaves
+} t_fit_limits;
+
+#define FIT_NYQUIST_RATIO 0.45f  // Highest fitted frequency, relative to the sampling rate
+
+// Fits num_shelf SHELF then num_peq PEQ bands (MAXELEM at most) to a target magnitude curve, given
+// in dB at num_freqs frequencies (log-spaced, typically), at the sampling rate of the bank. Each
+// band is placed on the largest remaining error and fitted alone, then all bands are refined
+// together by damped Gauss-Newton on their analytic magnitude response. The result only depends on
+// the arguments. Returns a list for peqbank_setup, to free with free_filters, and the RMS error in
+// dB over the frequencies in *error_db, or NULL if the arguments are out of range. limits may be
+// NULL for the defaults: 20 Hz to FIT_NYQUIST_RATIO, 18 dB, 0.05 to 4 octaves.
+t_filter **peqbank_fit(t_peqbank *x,
+                       const float *freqs,
+                       const float *target_db,
+                       int num_freqs,
+                       int num_peq,
+                       int num_shelf,
+                       const t_fit_limits *limits,
+                       float *error_db);
+
+// Optional headroom compensation, applied by peqbank_compute: when the peak gain of the design
+// over frequency exceeds 0 dB, the numerator of its first section that is not a dynamic band is
+// scaled down by the excess, which keeps boosts from clipping without a limiter. A list of dynamic
+// bands only gets a gain section after them. With per-channel filters, every channel is scaled by
+// the largest excess, keeping the balance between them, and none is when a list has no section
+// left for its gain. The gain that dynamic bands add beyond their static gain is not covered.
+void peqbank_set_headroom(t_peqbank *x, int enabled);
+// Attenuation in dB applied to the last design: its peak gain above 0 dB. 0 when the compensation
+// is off or could not be applied.
+float peqbank_get_headroom(t_peqbank *x);
+int peqbank_optimize_coeffs(
+    float *coeff, int nbiquads, float sampling_rate, float tolerance, float max_error_db);
 
 #endif  // peqbank_h
@@ -0,0 +1,64 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef peqbank_adapter_h
+#define peqbank_adapter_h
+
+#include "PeqBank/peqbank.h"
+
+// Block-size adapter: accepts host callbacks of any size and runs the bank on blocks of a fixed
+// size, the buffer size the bank was created with.
+//
+// ADAPT_BUFFERED accumulates input until a full block is available and plays the processed blocks
+// from a ring, at a constant latency of block - 1 frames. ADAPT_DIRECT has no latency: each host
+// buffer is processed in place as full blocks followed by one shorter remainder block.
+//
+// The adapter is driven from the audio thread only, so its rings need no locking.
+
+enum { ADAPT_BUFFERED, ADAPT_DIRECT };
+
+typedef struct _peqbank_adapter {
+  t_peqbank *x;
+  int b_mode;      // ADAPT_BUFFERED or ADAPT_DIRECT
+  int b_block;     // Internal block size
+  int b_channels;  // Number of audio channels
+  int b_latency;   // Latency in frames
+
+  float *s_in;    // Input block being filled, interleaved
+  int s_fill;     // Frames in s_in
+  float *s_ring;  // Output ring, interleaved, 2 * b_block frames
+  int s_read;     // Read position in the ring, in frames
+  int s_write;    // Write position in the ring, always a multiple of b_block
+} t_peqbank_adapter;
+
+t_peqbank_adapter *peqbank_adapter_new(t_peqbank *x, int mode);
+void peqbank_adapter_free(t_peqbank_adapter *a);
+void peqbank_adapter_clear(t_peqbank_adapter *a);
+int peqbank_adapter_latency(t_peqbank_adapter *a);
+// Process num_frames frames of interleaved audio, any number, and return num_frames
+int peqbank_adapter_float(t_peqbank_adapter *a,
+                          const float *sig_input,
+                          float *sig_output,
+                          int num_frames);
+int peqbank_adapter_int16(t_peqbank_adapter *a,
+                          const int16_t *sig_input,
+                          int16_t *sig_output,
+                          int num_frames);
+
+#endif  // peqbank_adapter_h
@@ -0,0 +1,65 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef peqbank_crossover_h
+#define peqbank_crossover_h
+
+#include "PeqBank/peqbank.h"
+
+// Linkwitz-Riley crossover: splits interleaved audio into num_bands planar band outputs in one
+// pass, for multiband processing.
+//
+// Each split is a lowpass and a highpass made of the same Butterworth sections run twice, designed
+// with compute_lphp without ripple. The highpass output feeds the next split, so the sections above
+// a split are shared by all the higher bands. Each lower band then goes through the allpass of
+// every split above its own, which aligns the phase of all bands: they add up to the input run
+// through the allpasses of all splits, with a flat magnitude response.
+
+#define CROSSOVER_MAX_BANDS 8
+#define CROSSOVER_MAX_ORDER 16  // Linkwitz-Riley order, a multiple of 4
+
+typedef struct _peqbank_crossover {
+  int b_channels;     // Number of audio channels
+  int b_bands;        // Number of bands, separated by b_bands - 1 splits
+  int b_sections;     // Butterworth sections per filter, order / 4
+  int b_nstate;       // Sections run per channel
+  float *b_lowpass;   // Per split: b_sections sections, each run twice
+  float *b_highpass;  // Per split: b_sections sections, each run twice
+  float *b_allpass;   // Per split: b_sections allpass sections with the poles of the split
+  float *b_state;     // Per channel and section run: x[n-1], x[n-2], y[n-1], y[n-2]
+} t_peqbank_crossover;
+
+// freqs holds the num_bands - 1 split frequencies in increasing order, below the Nyquist
+// frequency of the bank, whose sampling rate and channel count are used. Returns NULL if the
+// parameters are out of range.
+t_peqbank_crossover *peqbank_crossover_new(t_peqbank *x,
+                                           const float *freqs,
+                                           int num_bands,
+                                           int order);
+void peqbank_crossover_free(t_peqbank_crossover *c);
+void peqbank_crossover_clear(t_peqbank_crossover *c);
+// Splits num_frames frames of interleaved audio, any number. Band b of channel ch is written to
+// band_outputs[b * b_channels + ch], num_frames samples, which must not overlap the input.
+void peqbank_crossover_float(t_peqbank_crossover *c,
+                             const float *sig_input,
+                             float **band_outputs,
+                             int num_frames);
+
+#endif  // peqbank_crossover_h
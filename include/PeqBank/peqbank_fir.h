@@ -0,0 +1,71 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+//
+
+#ifndef peqbank_fir_h
+#define peqbank_fir_h
+
+#include "PeqBank/peqbank.h"
+
+// Linear-phase engine: the magnitude response of a configured t_peqbank is turned into a
+// symmetric FIR which is applied with uniformly partitioned overlap-save FFT convolution.
+// Channels are processed in pairs, packed into the real and imaginary parts of one complex FFT.
+// Both channels of a pair go through the same kernel, so banks with per-channel filter lists
+// (peqbank_setup_channels) are rejected: peqbank_fir_new returns NULL and peqbank_fir_design -1.
+
+typedef struct _peqbank_fft {
+  int n;         // FFT size (power of two)
+  int *bitrev;   // Bit reversal permutation
+  float *twcos;  // Twiddle factors, n/2 each
+  float *twsin;
+} t_peqbank_fft;
+
+typedef struct _peqbank_fir {
+  float b_Fs;      // Sample rate
+  int b_channels;  // Number of audio channels
+  int b_taps;      // FIR length (odd, the filter is symmetric around b_taps / 2)
+  int b_block;     // Partition size, also the hop size of the convolution
+  int b_parts;     // Number of partitions
+  int b_latency;   // Total latency in samples: group delay of the FIR plus one partition
+
+  t_peqbank_fft fft;  // Plan of size 2 * b_block
+  float *h_spec;      // Partition spectra, b_parts * 2 * b_block complex values
+  float *fdl;         // Frequency domain delay line, per channel pair: b_parts spectra
+  int fdl_pos;        // Slot of the most recent input spectrum in the delay line
+  float *work;        // FFT scratch, 2 * b_block complex values
+  float **s_prev;     // Previous input partition, per channel
+  float **s_cur;      // Input partition being filled, per channel
+  float **s_out;      // Output partition being drained, per channel
+  int s_pos;          // Position within the current partition
+  int s_n;            // Size buffer
+} t_peqbank_fir;
+
+int peqbank_fft_init(t_peqbank_fft *plan, int n);
+void peqbank_fft_free(t_peqbank_fft *plan);
+void peqbank_fft(const t_peqbank_fft *plan, float *data, int inverse);
+
+t_peqbank_fir *peqbank_fir_new(t_peqbank *x, int num_taps, int block_size);
+int peqbank_fir_design(t_peqbank_fir *f, t_peqbank *x);  // -1 leaves the previous kernel
+void peqbank_fir_clear(t_peqbank_fir *f);
+void peqbank_fir_free(t_peqbank_fir *f);
+int peqbank_fir_latency(t_peqbank_fir *f);
+int peqbank_fir_callback_int16(t_peqbank_fir *f, int16_t *sig_input, int16_t *sig_output);
+int peqbank_fir_callback_float(t_peqbank_fir *f, float *sig_input, float *sig_output);
+
+#endif  // peqbank_fir_h
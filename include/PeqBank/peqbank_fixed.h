@@ -0,0 +1,71 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef peqbank_fixed_h
+#define peqbank_fixed_h
+
+#include "PeqBank/peqbank.h"
+
+// Fixed-point engine for integer pipelines: runs the cascade designed by a bank with integer
+// arithmetic only, straight on interleaved int16 or Q31 samples.
+//
+// Coefficients are quantized to Q2.30, the numerator of a section being scaled down by a power of
+// two when its gain needs it. Samples run as Q4.27 (int16 input keeps 12 extra bits, Q31 input is
+// rounded to 28 bits), saturated at 18 dB above full scale, with 64-bit accumulators and
+// first-order error feedback, which keeps the requantization noise of sections with poles close to
+// DC from being amplified. Against the float engine, the output stays within an SNR of
+// FIXED_MIN_SNR_DB on program material with Q31 samples, and of FIXED_MIN_SNR_INT16_DB with int16
+// samples, where the quantization of the 16-bit output dominates (see test5 in main.c).
+//
+// Coefficients are requantized whenever those of the bank change, by a swap or by the in-place
+// update of a dynamic band, and apply from the next call without interpolation, like FAST mode.
+// Per-channel filter lists are supported.
+
+#define FIXED_FRAC 30                 // Coefficient fraction bits
+#define FIXED_SAMPLE_SHIFT 12         // Extra fraction bits of int16 samples in the Q4.27 format
+#define FIXED_BLOCK 256               // Frames converted and filtered per pass
+#define FIXED_MIN_SNR_DB 90.0f        // Guaranteed SNR against the float engine, Q31 samples
+#define FIXED_MIN_SNR_INT16_DB 65.0f  // Same with int16 samples, bounded by the 16-bit output
+
+typedef struct _peqbank_fixed {
+  t_peqbank *x;        // Bank whose coefficients are run
+  int b_channels;      // Number of audio channels
+  int b_nbiquads;      // Number of biquads quantized
+  uint64_t b_swaps;    // x->b_generation when the coefficients were quantized
+  int32_t *b_coeff;    // Q2.30 coefficients, [channel][biquad][coeff]
+  int *b_shift;        // Per channel and biquad: numerator coefficients are scaled by 2^-shift
+  int32_t *b_state;    // Per channel and biquad: x[n-1], x[n-2], y[n-1], y[n-2]
+  int64_t *b_err;      // Per channel and biquad: error feedback
+  int32_t *s_work;     // FIXED_BLOCK interleaved frames being filtered
+} t_peqbank_fixed;
+
+t_peqbank_fixed *peqbank_fixed_new(t_peqbank *x);
+void peqbank_fixed_free(t_peqbank_fixed *f);
+void peqbank_fixed_clear(t_peqbank_fixed *f);
+// Process num_frames frames of interleaved audio, any number, in place or not
+void peqbank_fixed_int16(t_peqbank_fixed *f,
+                         const int16_t *sig_input,
+                         int16_t *sig_output,
+                         int num_frames);
+void peqbank_fixed_int32(t_peqbank_fixed *f,
+                         const int32_t *sig_input,
+                         int32_t *sig_output,
+                         int num_frames);
+
+#endif  // peqbank_fixed_h
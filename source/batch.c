@@ -0,0 +1,367 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#define _FILE_OFFSET_BITS 64
+
+#include "batch.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BATCH_LINE 4096
+#define BATCH_MAX_THREADS 256
+
+enum { JOB_PENDING, JOB_SKIPPED, JOB_DONE, JOB_FAILED };
+
+typedef struct _batch_job {
+  t_render_config cfg;
+  char *line;    // Owns the strings cfg points into
+  int64_t size;  // Input size in bytes, longest jobs are scheduled first
+  int status;
+  int worker;
+  t_render_result result;
+} t_batch_job;
+
+// Jobs queued on one worker. The owner takes from the head, which holds its longest jobs, and
+// idle workers steal from the tail, which holds its shortest ones.
+typedef struct _batch_deque {
+  pthread_mutex_t lock;
+  int *jobs;
+  int head;
+  int tail;
+} t_batch_deque;
+
+// Idle banks, reused by jobs with the same sampling rate, channel count and block size
+typedef struct _batch_pool {
+  pthread_mutex_t lock;
+  t_peqbank **banks;
+  int count;
+} t_batch_pool;
+
+typedef struct _batch {
+  t_batch_job *jobs;
+  int num_jobs;
+  t_batch_deque *deques;
+  int num_workers;
+  t_batch_pool pool;
+  pthread_mutex_t report_lock;  // Serializes progress lines and journal appends
+  FILE *journal;
+  int finished;
+} t_batch;
+
+typedef struct _batch_worker {
+  t_batch *batch;
+  int id;
+} t_batch_worker;
+
+static int cmp_str(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int64_t file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (int64_t)st.st_size : -1;
+}
+
+static int parse_job(t_batch_job *job, const char *text, const t_render_config *defaults) {
+  memset(job, 0, sizeof(*job));
+  job->cfg = *defaults;
+  job->cfg.pipeline = 0;  // the pool already keeps every core busy
+  job->cfg.segments = 0;
+  job->line = strdup(text);
+  if (job->line == NULL) return -1;
+
+  char *fields[6];
+  int n = 0;
+  for (char *tok = strtok(job->line, " \t\r\n"); tok && n < 6; tok = strtok(NULL, " \t\r\n")) {
+    fields[n++] = tok;
+  }
+  if (n < 3) return -1;
+  job->cfg.in_path = fields[0];
+  job->cfg.out_path = fields[1];
+  job->cfg.filters = fields[2];
+  if (n > 3) job->cfg.format = render_parse_format(fields[3]);
+  if (n > 4) job->cfg.sampling_rate = atoi(fields[4]);
+  if (n > 5) job->cfg.channels = atoi(fields[5]);
+  if (job->cfg.format < 0 || job->cfg.sampling_rate <= 0 || job->cfg.channels <= 0) return -1;
+  return 0;
+}
+
+static int load_manifest(t_batch *b, const t_batch_config *cfg) {
+  FILE *f = fopen(cfg->manifest, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s\n", cfg->manifest);
+    return -1;
+  }
+  char line[BATCH_LINE];
+  int capacity = 0, lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    const char *p = line + strspn(line, " \t\r\n");
+    if (*p == '\0' || *p == '#') continue;
+    if (b->num_jobs == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      t_batch_job *jobs = (t_batch_job *)realloc(b->jobs, capacity * sizeof(t_batch_job));
+      if (jobs == NULL) break;
+      b->jobs = jobs;
+    }
+    t_batch_job *job = &b->jobs[b->num_jobs];
+    if (parse_job(job, p, &cfg->defaults) != 0) {
+      fprintf(stderr, "%s:%d: invalid job\n", cfg->manifest, lineno);
+      free(job->line);
+      fclose(f);
+      return -1;
+    }
+    job->size = file_size(job->cfg.in_path);
+    b->num_jobs++;
+  }
+  fclose(f);
+  return 0;
+}
+
+// Marks the jobs whose output is listed in the journal, and still exists, as skipped
+static void load_journal(t_batch *b, const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return;
+  char line[BATCH_LINE];
+  char **done = NULL;
+  int count = 0, capacity = 0;
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      char **grown = (char **)realloc(done, capacity * sizeof(char *));
+      if (grown == NULL) break;
+      done = grown;
+    }
+    if ((done[count] = strdup(line)) != NULL) count++;
+  }
+  fclose(f);
+
+  qsort(done, count, sizeof(char *), cmp_str);
+  for (int i = 0; i < b->num_jobs; i++) {
+    const char *out = b->jobs[i].cfg.out_path;
+    if (count && bsearch(&out, done, count, sizeof(char *), cmp_str) && file_size(out) >= 0) {
+      b->jobs[i].status = JOB_SKIPPED;
+    }
+  }
+  for (int i = 0; i < count; i++) free(done[i]);
+  free(done);
+}
+
+static t_peqbank *pool_acquire(t_batch_pool *pool, const t_render_config *cfg) {
+  t_peqbank *x = NULL;
+  pthread_mutex_lock(&pool->lock);
+  for (int i = 0; i < pool->count; i++) {
+    t_peqbank *p = pool->banks[i];
+    if (p->b_Fs == (float)cfg->sampling_rate && p->b_channels == cfg->channels &&
+        p->s_n == cfg->block) {
+      x = p;
+      pool->banks[i] = pool->banks[--pool->count];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return x ? x : peqbank_new(cfg->sampling_rate, cfg->channels, cfg->block);
+}
+
+// The pool holds at most one bank per job, so it never needs to grow past num_jobs
+static void pool_release(t_batch_pool *pool, t_peqbank *x) {
+  pthread_mutex_lock(&pool->lock);
+  pool->banks[pool->count++] = x;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static int deque_take(t_batch_deque *d, int steal) {
+  int job = -1;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail) job = steal ? d->jobs[--d->tail] : d->jobs[d->head++];
+  pthread_mutex_unlock(&d->lock);
+  return job;
+}
+
+static int next_job(t_batch *b, int id) {
+  int job = deque_take(&b->deques[id], 0);
+  for (int i = 1; job < 0 && i < b->num_workers; i++) {
+    job = deque_take(&b->deques[(id + i) % b->num_workers], 1);
+  }
+  return job;
+}
+
+static void run_job(t_batch *b, t_batch_job *job, int worker) {
+  t_render_config cfg = job->cfg;
+  size_t len = strlen(cfg.out_path);
+  char *part = (char *)malloc(len + 6);
+  t_peqbank *x = part ? pool_acquire(&b->pool, &cfg) : NULL;
+  int err = -1;
+  if (x) {
+    snprintf(part, len + 6, "%s.part", cfg.out_path);
+    cfg.out_path = part;
+    err = render_file_bank(&cfg, x, &job->result);
+    pool_release(&b->pool, x);
+    if (err == 0) err = rename(part, job->cfg.out_path);
+    if (err != 0) remove(part);
+  }
+  free(part);
+  job->status = err == 0 ? JOB_DONE : JOB_FAILED;
+  job->worker = worker;
+
+  double audio_sec = (double)job->result.frames / cfg.sampling_rate;
+  double wall_sec = job->result.ns * 1e-9;
+  pthread_mutex_lock(&b->report_lock);
+  b->finished++;
+  if (err == 0) {
+    fprintf(b->journal, "%s\n", job->cfg.out_path);
+    fflush(b->journal);
+    printf("[%d/%d] %s: %.1f s of audio in %.3f s, %.1fx realtime (worker %d)\n",
+           b->finished,
+           b->num_jobs,
+           job->cfg.out_path,
+           audio_sec,
+           wall_sec,
+           wall_sec > 0.0 ? audio_sec / wall_sec : 0.0,
+           worker);
+  } else {
+    printf("[%d/%d] %s: FAILED\n", b->finished, b->num_jobs, job->cfg.out_path);
+  }
+  fflush(stdout);
+  pthread_mutex_unlock(&b->report_lock);
+}
+
+static void *worker_main(void *arg) {
+  t_batch_worker *w = (t_batch_worker *)arg;
+  int job;
+  while ((job = next_job(w->batch, w->id)) >= 0) run_job(w->batch, &w->batch->jobs[job], w->id);
+  return NULL;
+}
+
+static t_batch_job *sort_jobs;  // qsort has no context argument in C99
+
+static int cmp_by_size(const void *a, const void *b) {
+  int64_t sa = sort_jobs[*(const int *)a].size;
+  int64_t sb = sort_jobs[*(const int *)b].size;
+  return (sa < sb) - (sa > sb);
+}
+
+int batch_run(const t_batch_config *cfg) {
+  t_batch b;
+  memset(&b, 0, sizeof(b));
+  if (load_manifest(&b, cfg) != 0) {
+    for (int i = 0; i < b.num_jobs; i++) free(b.jobs[i].line);
+    free(b.jobs);
+    return -1;
+  }
+
+  size_t len = strlen(cfg->manifest);
+  char *journal_path = (char *)malloc(len + 6);
+  snprintf(journal_path, len + 6, "%s.done", cfg->manifest);
+  load_journal(&b, journal_path);
+  b.journal = fopen(journal_path, "a");
+  free(journal_path);
+  if (b.journal == NULL) {
+    fprintf(stderr, "Cannot open the journal of %s\n", cfg->manifest);
+    for (int i = 0; i < b.num_jobs; i++) free(b.jobs[i].line);
+    free(b.jobs);
+    return -1;
+  }
+
+  // Deal the pending jobs, longest first, round-robin across the workers
+  int *order = (int *)malloc((b.num_jobs + 1) * sizeof(int));
+  int pending = 0, skipped = 0;
+  for (int i = 0; i < b.num_jobs; i++) {
+    if (b.jobs[i].status == JOB_SKIPPED) {
+      skipped++;
+    } else {
+      order[pending++] = i;
+    }
+  }
+  sort_jobs = b.jobs;
+  qsort(order, pending, sizeof(int), cmp_by_size);
+
+  int threads = cfg->threads > 0 ? cfg->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  b.num_workers = max(1, min(min(threads, BATCH_MAX_THREADS), max(pending, 1)));
+  b.deques = (t_batch_deque *)calloc(b.num_workers, sizeof(t_batch_deque));
+  b.pool.banks = (t_peqbank **)malloc((pending + 1) * sizeof(t_peqbank *));
+  pthread_mutex_init(&b.pool.lock, NULL);
+  pthread_mutex_init(&b.report_lock, NULL);
+  for (int w = 0; w < b.num_workers; w++) {
+    pthread_mutex_init(&b.deques[w].lock, NULL);
+    b.deques[w].jobs = (int *)malloc((pending / b.num_workers + 1) * sizeof(int));
+  }
+  for (int i = 0; i < pending; i++) {
+    t_batch_deque *d = &b.deques[i % b.num_workers];
+    d->jobs[d->tail++] = order[i];
+  }
+  b.finished = skipped;
+  if (skipped) printf("Skipping %d jobs already recorded in the journal\n", skipped);
+
+  int64_t start = peqbank_clock_ns();
+  pthread_t tids[BATCH_MAX_THREADS];
+  t_batch_worker workers[BATCH_MAX_THREADS];
+  int started = 0;
+  for (int w = 1; w < b.num_workers; w++) {
+    workers[w].batch = &b;
+    workers[w].id = w;
+    if (pthread_create(&tids[w], NULL, worker_main, &workers[w]) != 0) break;
+    started = w;
+  }
+  workers[0].batch = &b;
+  workers[0].id = 0;
+  worker_main(&workers[0]);  // the calling thread works too, and steals from any failed start
+  for (int w = 1; w <= started; w++) pthread_join(tids[w], NULL);
+  int64_t wall_ns = peqbank_clock_ns() - start;
+
+  int done = 0, failed = 0;
+  double audio_sec = 0.0;
+  for (int i = 0; i < b.num_jobs; i++) {
+    t_batch_job *job = &b.jobs[i];
+    if (job->status == JOB_DONE) {
+      done++;
+      audio_sec += (double)job->result.frames / job->cfg.sampling_rate;
+    } else if (job->status == JOB_FAILED) {
+      failed++;
+    }
+  }
+  double wall_sec = wall_ns * 1e-9;
+  printf("Batch: %d done, %d skipped, %d failed on %d workers; %.1f s of audio in %.3f s, "
+         "%.1fx realtime\n",
+         done,
+         skipped,
+         failed,
+         b.num_workers,
+         audio_sec,
+         wall_sec,
+         wall_sec > 0.0 ? audio_sec / wall_sec : 0.0);
+
+  fclose(b.journal);
+  for (int i = 0; i < b.pool.count; i++) peqbank_free(b.pool.banks[i]);
+  for (int w = 0; w < b.num_workers; w++) {
+    pthread_mutex_destroy(&b.deques[w].lock);
+    free(b.deques[w].jobs);
+  }
+  pthread_mutex_destroy(&b.pool.lock);
+  pthread_mutex_destroy(&b.report_lock);
+  for (int i = 0; i < b.num_jobs; i++) free(b.jobs[i].line);
+  free(b.pool.banks);
+  free(b.deques);
+  free(b.jobs);
+  free(order);
+  return failed;
+}
@@ -0,0 +1,41 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef batch_h
+#define batch_h
+
+#include "render.h"
+
+// A manifest has one job per line: <input> <output> <filter spec> [format [rate [channels]]],
+// separated by spaces or tabs. Omitted fields come from defaults. Blank lines and lines starting
+// with '#' are ignored.
+//
+// Each output is written to <output>.part and renamed once complete, then recorded in the journal
+// <manifest>.done. Running the same manifest again skips the jobs recorded there.
+typedef struct _batch_config {
+  const char *manifest;
+  t_render_config defaults;  // Format, rate, channels and block size of every job
+  int threads;               // Worker threads, 0 for one per core
+} t_batch_config;
+
+// Runs every job of the manifest on a work-stealing pool. Returns the number of failed jobs, or -1
+// if the manifest cannot be read.
+int batch_run(const t_batch_config *cfg);
+
+#endif /* batch_h */
@@ -0,0 +1,364 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank.h"
+
+#include <limits.h>  // for INT_MAX
+
+// Microbenchmark of the processing kernels and coefficient designers.
+//
+//   PeqBankBench [--channels 1,2,16] [--sections 1,4,16] [--buffers 16,256,8192]
+//                [--callbacks int16,float] [--modes fast,smooth,svf-fast,svf-smooth]
+//                [--min-time 0.05] [--json results.json] [--quick]
+//
+// SMOOTH mode is measured with a coefficient swap before every block, so the interpolating kernel
+// runs each time instead of falling back to the FAST one. The svf- modes run the same with
+// state-variable sections.
+
+#define MAX_LIST 32
+#define SAMPLING_RATE 44100
+
+enum { CB_INT16, CB_FLOAT };
+#define MODE_SVF 2  // Added to FAST or SMOOTH for the state-variable topology
+
+typedef struct _bench_list {
+  int values[MAX_LIST];
+  int count;
+} t_bench_list;
+
+typedef struct _bench_config {
+  t_bench_list channels;
+  t_bench_list sections;
+  t_bench_list buffers;
+  t_bench_list callbacks;
+  t_bench_list modes;
+  double min_time;
+  const char *json_path;
+} t_bench_config;
+
+typedef struct _bench_result {
+  int callback;
+  int mode;
+  int channels;
+  int sections;
+  int buffer;
+  long blocks;
+  double ns_per_frame;
+  double samples_per_sec;
+  double section_samples_per_sec;
+} t_bench_result;
+
+static void set_list(t_bench_list *l, const int *values, int count) {
+  l->count = count;
+  for (int i = 0; i < count; i++) l->values[i] = values[i];
+}
+
+// Indexed by CB_INT16/CB_FLOAT and by FAST/SMOOTH plus MODE_SVF
+static const char *const callback_names[] = {"int16", "float"};
+static const char *const mode_names[] = {"smooth", "fast", "svf-smooth", "svf-fast"};
+#define NUM_CALLBACKS 2
+#define NUM_MODES 4
+
+// Parses a comma-separated list of names, stored as their index in names, or of positive integers
+// up to max when names is NULL. Returns 0 on anything else.
+static int parse_list(t_bench_list *l, const char *arg, const char *const *names, int max) {
+  l->count = 0;
+  while (l->count < MAX_LIST) {
+    size_t len = strcspn(arg, ",");
+    int value = -1;
+    if (names) {
+      for (int i = 0; i < max; i++) {
+        if (strlen(names[i]) == len && strncmp(arg, names[i], len) == 0) value = i;
+      }
+    } else {
+      char *end;
+      long v = strtol(arg, &end, 10);
+      if (end == arg + len && v > 0 && v <= max) value = (int)v;
+    }
+    if (value < 0) return 0;
+    l->values[l->count++] = value;
+    if (arg[len] == '\0') return 1;
+    arg += len + 1;
+  }
+  return 0;  // more than MAX_LIST values
+}
+
+// One PEQ band per section, spread over the spectrum so no section is trivial
+static t_filter **bench_filters(int sections) {
+  t_filter **filters = new_filters(sections);
+  for (int i = 0; i < sections; i++) {
+    float freq = 40.0f * peqbank_pow2(i * 9.0f / MAXELEM);
+    filters[i] = new_peq(freq, 1.0f, 0, (i % 2) ? 6.0f : -6.0f, (i % 2) ? 3.0f : -3.0f);
+  }
+  return filters;
+}
+
+static t_bench_result bench_kernel(
+    int callback, int mode, int channels, int sections, int buffer, double min_time) {
+  t_bench_result r = {callback, mode, channels, sections, buffer, 0, 0.0, 0.0, 0.0};
+  t_peqbank *x = peqbank_new(SAMPLING_RATE, channels, buffer);
+  t_filter **filters = bench_filters(sections);
+  int16_t *in16 = (int16_t *)malloc(buffer * channels * sizeof(int16_t));
+  int16_t *out16 = (int16_t *)malloc(buffer * channels * sizeof(int16_t));
+  float *inf = (float *)malloc(buffer * channels * sizeof(float));
+  float *outf = (float *)malloc(buffer * channels * sizeof(float));
+  float *designed = (float *)malloc(x->b_max * NBCOEFF * sizeof(float));
+
+  srand(1);
+  for (int i = 0; i < buffer * channels; i++) {
+    in16[i] = (int16_t)(0.25f * ((rand() % 65534) - 32767.0f));
+    inf[i] = in16[i] / 32767.0f;
+  }
+
+  x->b_mode = mode % MODE_SVF;
+  peqbank_set_topology(x, mode >= MODE_SVF ? TOPOLOGY_SVF : TOPOLOGY_DF);
+  peqbank_setup(x, filters);
+  memcpy(designed, x->coeff, x->b_max * NBCOEFF * sizeof(float));
+
+  int64_t budget = (int64_t)(min_time * 1e9);
+  int64_t elapsed = 0;
+  long blocks = 0;
+  for (int pass = 0; pass < 2; pass++) {  // first pass is a warm up
+    int64_t start = peqbank_clock_ns();
+    blocks = 0;
+    do {
+      for (int b = 0; b < 16; b++) {
+        if (x->b_mode == SMOOTH) {
+          memcpy(x->newcoeff, designed, x->b_nbiquads * NBCOEFF * sizeof(float));
+          swap_in_new_coeffs(x);
+        }
+        if (callback == CB_INT16) {
+          peqbank_callback_int16(x, in16, out16);
+        } else {
+          peqbank_callback_float(x, inf, outf);
+        }
+      }
+      blocks += 16;
+      elapsed = peqbank_clock_ns() - start;
+    } while (elapsed < (pass ? budget : budget / 4));
+  }
+
+  double frames = (double)blocks * buffer;
+  r.blocks = blocks;
+  r.ns_per_frame = elapsed / frames;
+  r.samples_per_sec = frames * channels / (elapsed * 1e-9);
+  r.section_samples_per_sec = r.samples_per_sec * x->b_nbiquads;
+
+  free(in16);
+  free(out16);
+  free(inf);
+  free(outf);
+  free(designed);
+  free_filters(filters);
+  peqbank_freemem(x);
+  free(x);
+  return r;
+}
+
+static double bench_design(int type, int order, double min_time) {
+  t_peqbank *x = peqbank_new(SAMPLING_RATE, 1, 64);
+  t_peq p = {1000.0f, 1.0f, 0.0f, 6.0f, 3.0f};
+  t_shelf s = {3.0f, 0.0f, -3.0f, 200.0f, 5000.0f};
+  t_lphp f = {4000.0f, 0.5f, order, LOWPASS};
+  int64_t budget = (int64_t)(min_time * 1e9);
+  int64_t start = peqbank_clock_ns();
+  int64_t elapsed = 0;
+  long calls = 0;
+
+  do {
+    for (int i = 0; i < 64; i++) {
+      // vary the frequency so the work cannot be hoisted out of the loop
+      p.freq_peak = s.freq_low = f.freq = 1000.0f + (float)(i & 7);
+      if (type == PEQ) {
+        compute_peq(x, &p, 0);
+      } else if (type == SHELF) {
+        compute_shelf(x, &s, 0);
+      } else {
+        compute_lphp(x, &f, 0);
+      }
+    }
+    calls += 64;
+    elapsed = peqbank_clock_ns() - start;
+  } while (elapsed < budget);
+
+  peqbank_freemem(x);
+  free(x);
+  return (double)elapsed / calls;
+}
+
+static const char *callback_name(int callback) {
+  return callback >= 0 && callback < NUM_CALLBACKS ? callback_names[callback] : "?";
+}
+
+static const char *mode_name(int mode) {
+  return mode >= 0 && mode < NUM_MODES ? mode_names[mode] : "?";
+}
+
+int main(int argc, char *argv[]) {
+  const int default_channels[] = {1, 2, 4, 8, 16};
+  const int default_sections[] = {1, 2, 4, 8, MAXELEM};
+  const int default_buffers[] = {16, 64, 256, 1024, 4096, 8192};
+  const int default_callbacks[] = {CB_INT16, CB_FLOAT};
+  const int default_modes[] = {FAST, SMOOTH};
+  const int quick_channels[] = {1, 2, 8};
+  const int quick_sections[] = {1, 4, MAXELEM};
+  const int quick_buffers[] = {64, 1024};
+
+  t_bench_config cfg;
+  set_list(&cfg.channels, default_channels, 5);
+  set_list(&cfg.sections, default_sections, 5);
+  set_list(&cfg.buffers, default_buffers, 6);
+  set_list(&cfg.callbacks, default_callbacks, 2);
+  set_list(&cfg.modes, default_modes, 2);
+  cfg.min_time = 0.05;
+  cfg.json_path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+    int ok = 1;
+    if (strcmp(arg, "--quick") == 0) {
+      set_list(&cfg.channels, quick_channels, 3);
+      set_list(&cfg.sections, quick_sections, 3);
+      set_list(&cfg.buffers, quick_buffers, 2);
+      cfg.min_time = 0.02;
+      continue;
+    } else if (!val) {
+      ok = 0;
+    } else if (strcmp(arg, "--channels") == 0) {
+      ok = parse_list(&cfg.channels, val, NULL, INT_MAX);
+    } else if (strcmp(arg, "--sections") == 0) {
+      ok = parse_list(&cfg.sections, val, NULL, MAXELEM);
+    } else if (strcmp(arg, "--buffers") == 0) {
+      ok = parse_list(&cfg.buffers, val, NULL, INT_MAX);
+    } else if (strcmp(arg, "--callbacks") == 0) {
+      ok = parse_list(&cfg.callbacks, val, callback_names, NUM_CALLBACKS);
+    } else if (strcmp(arg, "--modes") == 0) {
+      ok = parse_list(&cfg.modes, val, mode_names, NUM_MODES);
+    } else if (strcmp(arg, "--min-time") == 0) {
+      cfg.min_time = atof(val);
+    } else if (strcmp(arg, "--json") == 0) {
+      cfg.json_path = val;
+    } else {
+      ok = 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "Invalid argument: %s\n", arg);
+      exit(1);
+    }
+    i++;
+  }
+
+  int total = cfg.channels.count * cfg.sections.count * cfg.buffers.count * cfg.callbacks.count *
+              cfg.modes.count;
+  t_bench_result *results = (t_bench_result *)malloc(total * sizeof(t_bench_result));
+  int n = 0;
+
+  printf("%-6s %-10s %8s %8s %8s %12s %14s %18s\n",
+         "cb",
+         "mode",
+         "channels",
+         "sections",
+         "buffer",
+         "ns/frame",
+         "samples/s",
+         "section-samples/s");
+  for (int a = 0; a < cfg.callbacks.count; a++) {
+    for (int m = 0; m < cfg.modes.count; m++) {
+      for (int c = 0; c < cfg.channels.count; c++) {
+        for (int s = 0; s < cfg.sections.count; s++) {
+          for (int b = 0; b < cfg.buffers.count; b++) {
+            int sections = min(max(cfg.sections.values[s], 1), MAXELEM);
+            int buffer = max(cfg.buffers.values[b], 1);
+            t_bench_result r = bench_kernel(cfg.callbacks.values[a],
+                                            cfg.modes.values[m],
+                                            max(cfg.channels.values[c], 1),
+                                            sections,
+                                            buffer,
+                                            cfg.min_time);
+            printf("%-6s %-10s %8d %8d %8d %12.2f %14.4g %18.4g\n",
+                   callback_name(r.callback),
+                   mode_name(r.mode),
+                   r.channels,
+                   r.sections,
+                   r.buffer,
+                   r.ns_per_frame,
+                   r.samples_per_sec,
+                   r.section_samples_per_sec);
+            fflush(stdout);
+            results[n++] = r;
+          }
+        }
+      }
+    }
+  }
+
+  double design_peq = bench_design(PEQ, 0, cfg.min_time);
+  double design_shelf = bench_design(SHELF, 0, cfg.min_time);
+  double design_lphp[MAXORDER / 2];
+  printf("compute_peq: %.1f ns/call\n", design_peq);
+  printf("compute_shelf: %.1f ns/call\n", design_shelf);
+  for (int order = MINORDER; order <= MAXORDER; order += 2) {
+    design_lphp[order / 2 - 1] = bench_design(LPHP, order, cfg.min_time);
+    printf("compute_lphp order %d: %.1f ns/call\n", order, design_lphp[order / 2 - 1]);
+  }
+
+  if (cfg.json_path) {
+    FILE *f = strcmp(cfg.json_path, "-") == 0 ? stdout : fopen(cfg.json_path, "w");
+    if (!f) {
+      fprintf(stderr, "Could not open %s\n", cfg.json_path);
+      exit(1);
+    }
+    fprintf(f, "{\n  \"benchmark\": \"PeqBankBench\",\n");
+    fprintf(f, "  \"sampling_rate\": %d,\n  \"min_time\": %g,\n", SAMPLING_RATE, cfg.min_time);
+    fprintf(f, "  \"kernels\": [\n");
+    for (int i = 0; i < n; i++) {
+      t_bench_result *r = &results[i];
+      fprintf(f,
+              "    {\"callback\": \"%s\", \"mode\": \"%s\", \"channels\": %d, \"sections\": %d, "
+              "\"buffer\": %d, \"blocks\": %ld, \"ns_per_frame\": %.3f, \"samples_per_sec\": %.1f, "
+              "\"section_samples_per_sec\": %.1f}%s\n",
+              callback_name(r->callback),
+              mode_name(r->mode),
+              r->channels,
+              r->sections,
+              r->buffer,
+              r->blocks,
+              r->ns_per_frame,
+              r->samples_per_sec,
+              r->section_samples_per_sec,
+              i + 1 < n ? "," : "");
+    }
+    fprintf(f, "  ],\n  \"design\": [\n");
+    fprintf(f, "    {\"function\": \"compute_peq\", \"ns_per_call\": %.2f},\n", design_peq);
+    fprintf(f, "    {\"function\": \"compute_shelf\", \"ns_per_call\": %.2f},\n", design_shelf);
+    for (int order = MINORDER; order <= MAXORDER; order += 2) {
+      fprintf(f,
+              "    {\"function\": \"compute_lphp\", \"order\": %d, \"ns_per_call\": %.2f}%s\n",
+              order,
+              design_lphp[order / 2 - 1],
+              order < MAXORDER ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    if (f != stdout) fclose(f);
+  }
+
+  free(results);
+  return 0;
+}
@@ -0,0 +1,373 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+// Real-time deadline simulation. An audio thread wakes up every time a host would deliver a block,
+// runs the callback and checks that it finished before the block period elapsed, while a control
+// thread posts parameter changes.
+//
+//   PeqBankDeadline [--rate 48000] [--channels 2] [--blocks 256 | --blocks 441,480,1001]
+//                   [--random-blocks] [--duration 10] [--sections 8] [--mode fast|smooth]
+//                   [--changes 20] [--freerun] [--fifo] [--json results.json]
+
+#define MAX_BLOCKS 32
+#define HIST_PER_OCTAVE 4
+#define HIST_BUCKETS 96  // 0.25 us to about 4 s
+
+typedef struct _deadline_config {
+  int rate;
+  int channels;
+  int blocks[MAX_BLOCKS];
+  int num_blocks;
+  int random_blocks;
+  double duration;
+  int sections;
+  int mode;
+  double changes;  // Parameter changes per second, posted from the control thread
+  int freerun;     // Do not sleep until the next block is due
+  int fifo;        // Request SCHED_FIFO for the audio thread
+  const char *json_path;
+} t_deadline_config;
+
+typedef struct _deadline_shared {
+  t_peq staged;         // Parameters written by the control thread
+  atomic_int pending;   // Set by the control thread, cleared by the audio thread
+  atomic_int running;   // Cleared once the audio thread is done
+  atomic_long changes;  // Parameter changes applied by the audio thread
+} t_deadline_shared;
+
+typedef struct _deadline_stats {
+  long callbacks;
+  long misses;
+  int64_t worst_miss;    // Largest overrun past a deadline
+  int64_t worst_wakeup;  // Largest delay between a block being due and the callback starting
+  int64_t *proc;         // Processing time per callback
+  long hist[HIST_BUCKETS];
+} t_deadline_stats;
+
+static void timespec_from_ns(struct timespec *ts, int64_t ns) {
+  ts->tv_sec = (time_t)(ns / 1000000000);
+  ts->tv_nsec = (long)(ns % 1000000000);
+}
+
+static int hist_bucket(int64_t ns) {
+  if (ns < 250) return 0;
+  int b = (int)floor(HIST_PER_OCTAVE * log2(ns / 250.0)) + 1;
+  return min(b, HIST_BUCKETS - 1);
+}
+
+static double hist_lower_us(int b) {
+  return b == 0 ? 0.0 : 0.25 * pow(2.0, (b - 1) / (double)HIST_PER_OCTAVE);
+}
+
+static int cmp_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static int parse_blocks(t_deadline_config *cfg, const char *arg) {
+  cfg->num_blocks = 0;
+  while (*arg && cfg->num_blocks < MAX_BLOCKS) {
+    int b = atoi(arg);
+    if (b <= 0) return 0;
+    cfg->blocks[cfg->num_blocks++] = b;
+    const char *comma = strchr(arg, ',');
+    if (!comma) break;
+    arg = comma + 1;
+  }
+  return cfg->num_blocks > 0;
+}
+
+typedef struct _control_args {
+  t_deadline_shared *shared;
+  double changes;
+} t_control_args;
+
+// Sweeps the gain and centre frequency of the first band, like a user dragging a control
+static void *control_main(void *arg) {
+  t_control_args *a = (t_control_args *)arg;
+  int64_t period = (int64_t)(1e9 / a->changes);
+  int64_t next = peqbank_clock_ns();
+  long step = 0;
+
+  while (atomic_load(&a->shared->running)) {
+    next += period;
+    struct timespec ts;
+    timespec_from_ns(&ts, next);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    if (atomic_load(&a->shared->pending)) continue;  // previous change not consumed yet
+
+    float phase = (float)(step++ % 64) / 64.0f;
+    a->shared->staged.freq_peak = 200.0f * peqbank_pow2(5.0f * phase);
+    a->shared->staged.gain_peak = -12.0f + 24.0f * phase;
+    a->shared->staged.gain_bandwidth = a->shared->staged.gain_peak * 0.5f;
+    atomic_store(&a->shared->pending, 1);
+  }
+  return NULL;
+}
+
+static void run_audio(t_deadline_config *cfg, t_deadline_shared *sh, t_deadline_stats *st) {
+  int max_block = 0;
+  for (int i = 0; i < cfg->num_blocks; i++) max_block = max(max_block, cfg->blocks[i]);
+
+  t_peqbank *x = peqbank_new(cfg->rate, cfg->channels, max_block);
+  t_filter **filters = new_filters(cfg->sections);
+  for (int i = 0; i < cfg->sections; i++) {
+    filters[i] = new_peq(100.0f * (i + 1), 1.0f, 0.0f, (i % 2) ? 4.0f : -4.0f, (i % 2) ? 2 : -2);
+  }
+  x->b_mode = cfg->mode;
+  peqbank_setup(x, filters);
+  t_peq *live = (t_peq *)filters[0]->filter;
+  sh->staged = *live;
+
+  // A few seconds of noise, cycled through as input
+  int noise_frames = cfg->rate * 2;
+  int16_t *noise = (int16_t *)malloc((noise_frames + max_block) * cfg->channels * sizeof(int16_t));
+  int16_t *out = (int16_t *)malloc(max_block * cfg->channels * sizeof(int16_t));
+  srand(1);
+  for (int i = 0; i < (noise_frames + max_block) * cfg->channels; i++) {
+    noise[i] = (int16_t)(0.25f * ((rand() % 65534) - 32767.0f));
+  }
+
+  int64_t total_frames = (int64_t)(cfg->duration * cfg->rate);
+  int64_t frames = 0;
+  int64_t due = peqbank_clock_ns();
+  int pos = 0;
+  int idx = 0;
+  srand(2);
+
+  while (frames < total_frames) {
+    int n = cfg->random_blocks ? cfg->blocks[rand() % cfg->num_blocks]
+                               : cfg->blocks[idx++ % cfg->num_blocks];
+    int64_t period = (int64_t)n * 1000000000 / cfg->rate;
+
+    if (!cfg->freerun) {
+      struct timespec ts;
+      timespec_from_ns(&ts, due);
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    int64_t start = peqbank_clock_ns();
+    if (cfg->freerun) due = start;
+
+    if (atomic_load(&sh->pending)) {
+      *live = sh->staged;
+      peqbank_compute(x);
+      atomic_store(&sh->pending, 0);
+      atomic_fetch_add(&sh->changes, 1);
+    }
+    x->s_n = n;
+    peqbank_callback_int16(x, &noise[pos * cfg->channels], out);
+
+    int64_t end = peqbank_clock_ns();
+    int64_t deadline = due + period;
+    st->proc[st->callbacks] = end - start;
+    st->hist[hist_bucket(end - start)]++;
+    st->worst_wakeup = max(st->worst_wakeup, start - due);
+    if (end > deadline) {
+      st->misses++;
+      st->worst_miss = max(st->worst_miss, end - deadline);
+    }
+    st->callbacks++;
+
+    due = deadline;
+    frames += n;
+    pos = (pos + n) % noise_frames;
+  }
+
+  free(noise);
+  free(out);
+  free_filters(filters);
+  peqbank_freemem(x);
+  free(x);
+}
+
+int main(int argc, char *argv[]) {
+  t_deadline_config cfg = {48000, 2, {256}, 1, 0, 10.0, 8, SMOOTH, 20.0, 0, 0, NULL};
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+    int ok = 1;
+    if (strcmp(arg, "--random-blocks") == 0) {
+      cfg.random_blocks = 1;
+      continue;
+    } else if (strcmp(arg, "--freerun") == 0) {
+      cfg.freerun = 1;
+      continue;
+    } else if (strcmp(arg, "--fifo") == 0) {
+      cfg.fifo = 1;
+      continue;
+    } else if (!val) {
+      ok = 0;
+    } else if (strcmp(arg, "--rate") == 0) {
+      cfg.rate = atoi(val);
+      ok = cfg.rate > 0;
+    } else if (strcmp(arg, "--channels") == 0) {
+      cfg.channels = atoi(val);
+      ok = cfg.channels > 0;
+    } else if (strcmp(arg, "--blocks") == 0) {
+      ok = parse_blocks(&cfg, val);
+    } else if (strcmp(arg, "--duration") == 0) {
+      cfg.duration = atof(val);
+      ok = cfg.duration > 0;
+    } else if (strcmp(arg, "--sections") == 0) {
+      cfg.sections = atoi(val);
+      ok = cfg.sections > 0 && cfg.sections <= MAXELEM;
+    } else if (strcmp(arg, "--mode") == 0) {
+      cfg.mode = strcmp(val, "fast") == 0 ? FAST : SMOOTH;
+      ok = strcmp(val, "fast") == 0 || strcmp(val, "smooth") == 0;
+    } else if (strcmp(arg, "--changes") == 0) {
+      cfg.changes = atof(val);
+    } else if (strcmp(arg, "--json") == 0) {
+      cfg.json_path = val;
+    } else {
+      ok = 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "Invalid argument: %s\n", arg);
+      exit(1);
+    }
+    i++;
+  }
+
+  int min_block = cfg.blocks[0];
+  for (int i = 1; i < cfg.num_blocks; i++) min_block = min(min_block, cfg.blocks[i]);
+
+  t_deadline_shared sh;
+  memset(&sh, 0, sizeof(sh));
+  atomic_init(&sh.pending, 0);
+  atomic_init(&sh.running, 1);
+  atomic_init(&sh.changes, 0);
+
+  t_deadline_stats st;
+  memset(&st, 0, sizeof(st));
+  long max_callbacks = (long)(cfg.duration * cfg.rate / min_block) + 2;
+  st.proc = (int64_t *)malloc(max_callbacks * sizeof(int64_t));
+
+  if (cfg.fifo) {
+    struct sched_param sp;
+    sp.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0) {
+      fprintf(stderr, "Could not switch to SCHED_FIFO, running with the default policy\n");
+    }
+  }
+
+  pthread_t control;
+  t_control_args control_args = {&sh, cfg.changes};
+  int has_control = cfg.changes > 0 &&
+                    pthread_create(&control, NULL, control_main, &control_args) == 0;
+
+  run_audio(&cfg, &sh, &st);
+
+  atomic_store(&sh.running, 0);
+  if (has_control) pthread_join(control, NULL);
+
+  qsort(st.proc, st.callbacks, sizeof(int64_t), cmp_int64);
+  double sum = 0;
+  for (long i = 0; i < st.callbacks; i++) sum += st.proc[i];
+  double mean_us = st.callbacks ? sum / st.callbacks * 1e-3 : 0.0;
+  double p50_us = st.callbacks ? st.proc[st.callbacks / 2] * 1e-3 : 0.0;
+  double p99_us = st.callbacks ? st.proc[(long)(st.callbacks * 0.99)] * 1e-3 : 0.0;
+  double p999_us = st.callbacks ? st.proc[(long)(st.callbacks * 0.999)] * 1e-3 : 0.0;
+  double max_us = st.callbacks ? st.proc[st.callbacks - 1] * 1e-3 : 0.0;
+  double budget_us = 1e6 * min_block / cfg.rate;
+
+  printf("Rate %d Hz, %d channels, %d sections, %s mode, %s\n",
+         cfg.rate,
+         cfg.channels,
+         cfg.sections,
+         cfg.mode == FAST ? "fast" : "smooth",
+         cfg.freerun ? "free running" : "paced");
+  printf("Callbacks: %ld, parameter changes: %ld\n", st.callbacks, atomic_load(&sh.changes));
+  printf("Processing time (us): mean %.2f, p50 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+         mean_us,
+         p50_us,
+         p99_us,
+         p999_us,
+         max_us);
+  printf("Smallest block budget: %.2f us, worst case uses %.1f%%\n",
+         budget_us,
+         100.0 * max_us / budget_us);
+  printf("Worst wake-up delay: %.2f us\n", st.worst_wakeup * 1e-3);
+  printf("Deadline misses: %ld (%.4f%%), worst overrun %.2f us\n",
+         st.misses,
+         st.callbacks ? 100.0 * st.misses / st.callbacks : 0.0,
+         st.worst_miss * 1e-3);
+  printf("Histogram of processing time:\n");
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    if (st.hist[b] == 0) continue;
+    printf("  >= %10.2f us: %8ld\n", hist_lower_us(b), st.hist[b]);
+  }
+
+  if (cfg.json_path) {
+    FILE *f = strcmp(cfg.json_path, "-") == 0 ? stdout : fopen(cfg.json_path, "w");
+    if (!f) {
+      fprintf(stderr, "Could not open %s\n", cfg.json_path);
+      exit(1);
+    }
+    fprintf(f,
+            "{\n  \"rate\": %d,\n  \"channels\": %d,\n  \"sections\": %d,\n  \"mode\": \"%s\",\n",
+            cfg.rate,
+            cfg.channels,
+            cfg.sections,
+            cfg.mode == FAST ? "fast" : "smooth");
+    fprintf(f, "  \"blocks\": [");
+    for (int i = 0; i < cfg.num_blocks; i++) {
+      fprintf(f, "%d%s", cfg.blocks[i], i + 1 < cfg.num_blocks ? ", " : "");
+    }
+    fprintf(f, "],\n  \"paced\": %s,\n", cfg.freerun ? "false" : "true");
+    fprintf(f,
+            "  \"callbacks\": %ld,\n  \"parameter_changes\": %ld,\n",
+            st.callbacks,
+            atomic_load(&sh.changes));
+    fprintf(f,
+            "  \"processing_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, "
+            "\"max\": %.3f},\n",
+            mean_us,
+            p50_us,
+            p99_us,
+            p999_us,
+            max_us);
+    fprintf(f, "  \"worst_wakeup_us\": %.3f,\n", st.worst_wakeup * 1e-3);
+    fprintf(f, "  \"deadline_misses\": %ld,\n", st.misses);
+    fprintf(f, "  \"worst_overrun_us\": %.3f,\n", st.worst_miss * 1e-3);
+    fprintf(f, "  \"histogram\": [");
+    int first = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+      if (st.hist[b] == 0) continue;
+      fprintf(f,
+              "%s{\"from_us\": %.3f, \"count\": %ld}",
+              first ? "" : ", ",
+              hist_lower_us(b),
+              st.hist[b]);
+      first = 0;
+    }
+    fprintf(f, "]\n}\n");
+    if (f != stdout) fclose(f);
+  }
+
+  free(st.proc);
+  return st.misses > 0 ? 2 : 0;
+}
@@ -18,6 +18,13 @@
 // under the License.
 
 #include "PeqBank/peqbank.h"
+#include "PeqBank/peqbank_crossover.h"
+#include "PeqBank/peqbank_fir.h"
+#include "PeqBank/peqbank_fixed.h"
+#include "render.h"
+#ifndef _WIN32
+#include "batch.h"
+#endif
 
 const char *base_path = NULL;
 
@@ -25,13 +32,130 @@ int test1();  // 10 sec white noise, mono, lowpass and highpass pass filters at
 int test2();  // 10 sec, 4 pure tones, stereo, peq filters
 int test3();  // 10 sec white noise, stereo, shelf filters and sharp peq in the middle
 int test4();  // music filtered by various kinds of filters
+int test5();  // music filtered by the fixed-point engine, checked against the float engine
+int test6();  // target curve of 5 known bands, fitted back by peqbank_fit
+int test7();  // impulse split by a 4-band crossover, bands summed back to an allpass
+int test8();  // music with the look-ahead limiter, saved and restored midway into another bank
+int test9();  // response evaluator checked against the steady state of filtered sines
+int test10();  // linear-phase FIR checked against the IIR cascade on filtered sines
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: PeqBankCLI <base_path>\n"
+          "         Runs the tests, reading and writing test files in base_path\n"
+          "       PeqBankCLI --in <file> --out <file> --filters <spec> [--format s16|f32]\n"
+          "                  [--rate 44100] [--channels 2] [--block %d]\n"
+          "                  [--pipeline | --segments N [--tolerance %g]]\n"
+          "         Renders raw interleaved PCM, e.g. --filters \"highpass:500,0.5,8;"
+          "peq:3000,0.5,-3,12,3\"\n"
+          "       PeqBankCLI --batch <manifest> [--threads N] [--format s16|f32] [--rate 44100]\n"
+          "                  [--channels 2] [--block %d]\n"
+          "         Renders every \"<in> <out> <spec> [format [rate [channels]]]\" line of the\n"
+          "         manifest, skipping the outputs recorded in <manifest>.done\n",
+          RENDER_BLOCK,
+          RENDER_TOLERANCE,
+          RENDER_BLOCK);
+  exit(1);
+}
+
+static int render_main(int argc, char *argv[]) {
+  t_render_config cfg;
+  cfg.in_path = NULL;
+  cfg.out_path = NULL;
+  cfg.filters = NULL;
+  cfg.format = RENDER_S16;
+  cfg.sampling_rate = 44100;
+  cfg.channels = 2;
+  cfg.block = RENDER_BLOCK;
+  cfg.pipeline = 0;
+  cfg.segments = 0;
+  cfg.tolerance = RENDER_TOLERANCE;
+  const char *manifest = NULL;
+  int threads = 0;
+
+  for (int i = 1; i < argc; i += 2) {
+    const char *arg = argv[i];
+    const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--pipeline") == 0) {
+      cfg.pipeline = 1;
+      i--;
+    } else if (!val) {
+      usage();
+    } else if (strcmp(arg, "--in") == 0) {
+      cfg.in_path = val;
+    } else if (strcmp(arg, "--out") == 0) {
+      cfg.out_path = val;
+    } else if (strcmp(arg, "--filters") == 0) {
+      cfg.filters = val;
+    } else if (strcmp(arg, "--format") == 0) {
+      cfg.format = render_parse_format(val);
+    } else if (strcmp(arg, "--rate") == 0) {
+      cfg.sampling_rate = atoi(val);
+    } else if (strcmp(arg, "--channels") == 0) {
+      cfg.channels = atoi(val);
+    } else if (strcmp(arg, "--block") == 0) {
+      cfg.block = atoi(val);
+    } else if (strcmp(arg, "--segments") == 0) {
+      cfg.segments = atoi(val);
+    } else if (strcmp(arg, "--tolerance") == 0) {
+      cfg.tolerance = (float)atof(val);
+    } else if (strcmp(arg, "--batch") == 0) {
+      manifest = val;
+    } else if (strcmp(arg, "--threads") == 0) {
+      threads = atoi(val);
+    } else {
+      usage();
+    }
+  }
+  if (manifest) {
+#ifndef _WIN32
+    t_batch_config batch;
+    batch.manifest = manifest;
+    batch.defaults = cfg;
+    batch.threads = threads;
+    return batch_run(&batch) != 0;
+#else
+    fprintf(stderr, "Batch rendering is not available on this platform\n");
+    return 1;
+#endif
+  }
+  if (!cfg.in_path || !cfg.out_path || !cfg.filters || cfg.format < 0 || cfg.sampling_rate <= 0 ||
+      cfg.channels <= 0 || cfg.block <= 0 || cfg.tolerance <= 0.0f) {
+    usage();
+  }
+
+  t_render_result result;
+  if (render_file(&cfg, &result) != 0) return 1;
+
+  double audio_sec = (double)result.frames / cfg.sampling_rate;
+  double wall_sec = result.ns * 1e-9;
+  printf("Rendered %lld frames (%.1f s of audio) in %.3f s, %.1fx realtime\n",
+         (long long)result.frames,
+         audio_sec,
+         wall_sec,
+         wall_sec > 0.0 ? audio_sec / wall_sec : 0.0);
+  if (result.segments > 1) {
+    printf("Segments: %d, pre-roll %d frames each (%.1f%% extra processing)\n",
+           result.segments,
+           result.preroll,
+           100.0 * result.preroll * (result.segments - 1) / max(result.frames, (int64_t)1));
+  }
+  printf("Busy time: read %.3f s, process %.3f s, write %.3f s\n",
+         result.read_ns * 1e-9,
+         result.process_ns * 1e-9,
+         result.write_ns * 1e-9);
+  return 0;
+}
 
 int main(int argc, char *argv[]) {
+  if (argc > 1 && argv[1][0] == '-') {
+    return render_main(argc, argv);
+  }
   if (argc != 2) {
     fprintf(stderr,
             "Number of arguments not valid. This program expects one argument, the base path to "
             "the test files.\n");
-    exit(1);
+    usage();
   }
   base_path = argv[1];
   if (test1())
@@ -50,6 +174,30 @@ int main(int argc, char *argv[]) {
     printf("test4 succeeded!\n\n");
   else
     printf("test4 failed!\n\n");
+  if (test5())
+    printf("test5 succeeded!\n\n");
+  else
+    printf("test5 failed!\n\n");
+  if (test6())
+    printf("test6 succeeded!\n\n");
+  else
+    printf("test6 failed!\n\n");
+  if (test7())
+    printf("test7 succeeded!\n\n");
+  else
+    printf("test7 failed!\n\n");
+  if (test8())
+    printf("test8 succeeded!\n\n");
+  else
+    printf("test8 failed!\n\n");
+  if (test9())
+    printf("test9 succeeded!\n\n");
+  else
+    printf("test9 failed!\n\n");
+  if (test10())
+    printf("test10 succeeded!\n\n");
+  else
+    printf("test10 failed!\n\n");
 
   return 0;
 }
@@ -383,3 +531,428 @@ int test4() {
 
   return 1;
 }
+
+// Signal-to-noise ratio in dB of a signal against a reference, both scaled to [-1, 1]
+static double snr_db(const float *ref, const float *sig, int n) {
+  double power = 0, noise = 0;
+  for (int i = 0; i < n; i++) {
+    power += (double)ref[i] * ref[i];
+    noise += ((double)sig[i] - ref[i]) * ((double)sig[i] - ref[i]);
+  }
+  return 10 * log10(power / fmax(noise, 1e-30));
+}
+
+int test5() {
+  printf("Test5: music filtered by the fixed-point engine, checked against the float engine\n");
+  int sampling_rate = 44100;
+  int num_channels = 2;    // stereo
+  int buffer_size = 4096;  // callback buffer size
+  int num_frames = 943828;
+  int num_samples = num_frames * num_channels;
+
+  t_peqbank *x = peqbank_new(sampling_rate, num_channels, buffer_size);
+
+  if (!x) {
+    return -1;
+  }
+
+  int16_t *signal_in = (int16_t *)malloc(num_samples * sizeof(int16_t));
+  int16_t *signal_out = (int16_t *)malloc(num_samples * sizeof(int16_t));
+  int32_t *q31 = (int32_t *)malloc(num_samples * sizeof(int32_t));
+  float *reference = (float *)malloc(num_samples * sizeof(float));
+  float *fixed = (float *)malloc(num_samples * sizeof(float));
+
+  char path[256];
+
+  static FILE *fin;
+  snprintf(path, sizeof(path), "%s%s", base_path, "music_test.pcm");
+  if (!fin) fin = fopen(path, "rb");
+  fread(signal_in, sizeof(int16_t), num_samples, fin);
+  fclose(fin);
+
+  printf("Setting up filter\n");
+  t_filter **filters = new_filters(4);           // same filters as test4
+  filters[0] = new_shelf(0, -12, 0, 100, 5000);  // -12 db between 100 and 5000 Hz
+  filters[1] = new_highpass(500, 0.5, 8);        // cut below 500 Hz
+  filters[2] = new_peq(3000, 0.5, -3, 12, 3);    // bump at 3000 Hz
+  filters[3] = new_peq(4000, 0.25, 0, -6, -3);   // slight cut at 4000 Hz
+  x->b_mode = FAST;                              // the fixed-point engine does not interpolate
+  peqbank_setup(x, filters);                     // setup filters
+
+  t_peqbank_fixed *f = peqbank_fixed_new(x);
+  if (!f) {
+    return -1;
+  }
+
+  printf("Processing signal with the float engine\n");
+  for (int i = 0; i < num_samples; i++) reference[i] = signal_in[i] / 32768.0f;
+  for (int frame = 0; frame < num_frames;) {
+    x->s_n = min(buffer_size, num_frames - frame);
+    frame += peqbank_callback_float(
+        x, &reference[frame * num_channels], &reference[frame * num_channels]);
+  }
+  x->s_n = buffer_size;  // reset buffer size...
+
+  printf("Processing signal with the fixed-point engine, Q31\n");
+  for (int i = 0; i < num_samples; i++) q31[i] = signal_in[i] * 65536;
+  for (int frame = 0; frame < num_frames; frame += buffer_size) {
+    int n = min(buffer_size, num_frames - frame);
+    peqbank_fixed_int32(f, &q31[frame * num_channels], &q31[frame * num_channels], n);
+  }
+  for (int i = 0; i < num_samples; i++) fixed[i] = (float)(q31[i] / 2147483648.0);
+  double snr32 = snr_db(reference, fixed, num_samples);
+
+  printf("Processing signal with the fixed-point engine, int16\n");
+  peqbank_fixed_clear(f);
+  for (int frame = 0; frame < num_frames; frame += buffer_size) {
+    int n = min(buffer_size, num_frames - frame);
+    peqbank_fixed_int16(f, &signal_in[frame * num_channels], &signal_out[frame * num_channels], n);
+  }
+  for (int i = 0; i < num_samples; i++) fixed[i] = signal_out[i] / 32768.0f;
+  double snr16 = snr_db(reference, fixed, num_samples);
+
+  printf("SNR against the float engine: %.1f dB (Q31), %.1f dB (int16), required %.1f / %.1f dB\n",
+         snr32,
+         snr16,
+         FIXED_MIN_SNR_DB,
+         FIXED_MIN_SNR_INT16_DB);
+
+  static FILE *fou;
+  snprintf(path, sizeof(path), "%s%s", base_path, "test5_out.pcm");
+  if (!fou) fou = fopen(path, "wb");
+  fwrite(signal_out, num_samples, sizeof(int16_t), fou);
+  fclose(fou);
+
+  free(signal_in);
+  free(signal_out);
+  free(q31);
+  free(reference);
+  free(fixed);
+  peqbank_fixed_free(f);
+  free_filters(filters);
+  free(x);
+
+  return snr32 >= FIXED_MIN_SNR_DB && snr16 >= FIXED_MIN_SNR_INT16_DB;
+}
+
+int test6() {
+  printf("Test6: target curve of 5 known bands, fitted back by peqbank_fit\n");
+  int sampling_rate = 48000;
+  int num_freqs = 256;
+
+  t_peqbank *x = peqbank_new(sampling_rate, 1, 64);
+
+  if (!x) {
+    return -1;
+  }
+
+  float *freqs = (float *)malloc(num_freqs * sizeof(float));
+  float *target = (float *)malloc(num_freqs * sizeof(float));
+  float *fitted = (float *)malloc(num_freqs * sizeof(float));
+  for (int i = 0; i < num_freqs; i++) {
+    freqs[i] = 20.0f * powf(1000.0f, (float)i / (num_freqs - 1));  // 20 Hz to 20 kHz
+  }
+
+  printf("Setting up filter\n");
+  t_filter **filters = new_filters(5);           // the bands to recover
+  filters[0] = new_shelf(6, 0, -4, 120, 6000);   // +6 dB below 120 Hz, -4 dB above 6000 Hz
+  filters[1] = new_peq(300, 1.0, 0, -5, -2.5);   // wide cut at 300 Hz
+  filters[2] = new_peq(2500, 0.4, 0, 7, 3.5);    // bump at 2500 Hz
+  filters[3] = new_peq(6000, 0.2, 0, -9, -4.5);  // narrow cut at 6000 Hz
+  filters[4] = new_peq(11000, 1.5, 0, 3, 1.5);   // air
+  peqbank_setup(x, filters);
+  peqbank_response(x, freqs, num_freqs, target, NULL, NULL);
+
+  printf("Fitting 1 shelf and 4 peq bands\n");
+  float error_db = 0.0f;
+  t_filter **fit = peqbank_fit(x, freqs, target, num_freqs, 4, 1, NULL, &error_db);
+  if (!fit) {
+    return 0;
+  }
+  peqbank_setup(x, fit);
+  peqbank_print_info(x);
+  peqbank_response(x, freqs, num_freqs, fitted, NULL, NULL);
+
+  float max_error = 0.0f;
+  for (int i = 0; i < num_freqs; i++) max_error = fmaxf(max_error, fabsf(fitted[i] - target[i]));
+  printf("Fit error: %.4f dB RMS, %.4f dB max\n", error_db, max_error);
+
+  free(freqs);
+  free(target);
+  free(fitted);
+  free_filters(filters);
+  free_filters(fit);
+  peqbank_free(x);
+
+  return error_db < 0.01f && max_error < 0.05f;
+}
+
+int test7() {
+  printf("Test7: impulse split by a 4-band crossover, bands summed back to an allpass\n");
+  int sampling_rate = 44100;
+  int num_channels = 2;  // stereo
+  int num_bands = 4;
+  int num_frames = 8192;
+  int num_freqs = 32;
+
+  t_peqbank *x = peqbank_new(sampling_rate, num_channels, 64);
+
+  if (!x) {
+    return -1;
+  }
+
+  printf("Setting up crossover\n");
+  float splits[3] = {120, 1000, 6000};
+  t_peqbank_crossover *c = peqbank_crossover_new(x, splits, num_bands, 8);  // LR8
+  if (!c) {
+    return -1;
+  }
+
+  // An impulse on each channel, so that the sum of the bands is the impulse response of the split
+  float *signal_in = (float *)calloc(num_frames * num_channels, sizeof(float));
+  float **bands = (float **)malloc(num_bands * num_channels * sizeof(float *));
+  for (int i = 0; i < num_bands * num_channels; i++) {
+    bands[i] = (float *)malloc(num_frames * sizeof(float));
+  }
+  for (int ch = 0; ch < num_channels; ch++) signal_in[ch] = 1.0f;
+
+  printf("Processing signal\n");
+  peqbank_crossover_float(c, signal_in, bands, num_frames);
+
+  // Magnitude of the summed response at log-spaced frequencies, by direct DFT
+  float max_error = 0.0f;
+  for (int ch = 0; ch < num_channels; ch++) {
+    for (int k = 0; k < num_freqs; k++) {
+      double w = TWOPI * 20.0 * pow(1000.0, (double)k / (num_freqs - 1)) / sampling_rate;
+      double re = 0, im = 0;
+      for (int i = 0; i < num_frames; i++) {
+        double sum = 0;
+        for (int b = 0; b < num_bands; b++) sum += bands[b * num_channels + ch][i];
+        re += sum * cos(w * i);
+        im -= sum * sin(w * i);
+      }
+      max_error = fmaxf(max_error, fabsf((float)(10 * log10(re * re + im * im))));
+    }
+  }
+  printf("Summed bands: %.4f dB from flat at most\n", max_error);
+
+  for (int i = 0; i < num_bands * num_channels; i++) free(bands[i]);
+  free(bands);
+  free(signal_in);
+  peqbank_crossover_free(c);
+  peqbank_free(x);
+
+  return max_error < 0.05f;
+}
+
+int test8() {
+  printf("Test8: music with the look-ahead limiter, saved and restored midway into another bank\n");
+  int sampling_rate = 44100;
+  int num_channels = 2;    // stereo
+  int buffer_size = 4096;  // callback buffer size
+  int num_frames = 943828;
+  int num_samples = num_frames * num_channels;
+  int half = num_frames / 2 / buffer_size * buffer_size;
+
+  t_peqbank *x = peqbank_new(sampling_rate, num_channels, buffer_size);
+  t_peqbank *y = peqbank_new(sampling_rate, num_channels, buffer_size);
+
+  if (!x || !y) {
+    return -1;
+  }
+
+  int16_t *signal_in = (int16_t *)malloc(num_samples * sizeof(int16_t));
+  float *reference = (float *)malloc(num_samples * sizeof(float));
+  float *restored = (float *)malloc(num_samples * sizeof(float));
+
+  char path[256];
+
+  static FILE *fin;
+  snprintf(path, sizeof(path), "%s%s", base_path, "music_test.pcm");
+  if (!fin) fin = fopen(path, "rb");
+  fread(signal_in, sizeof(int16_t), num_samples, fin);
+  fclose(fin);
+
+  printf("Setting up filter\n");
+  t_filter **filters = new_filters(4);           // same filters as test4
+  filters[0] = new_shelf(0, -12, 0, 100, 5000);  // -12 db between 100 and 5000 Hz
+  filters[1] = new_highpass(500, 0.5, 8);        // cut below 500 Hz
+  filters[2] = new_peq(3000, 0.5, -3, 12, 3);    // bump at 3000 Hz
+  filters[3] = new_peq(4000, 0.25, 0, -6, -3);   // slight cut at 4000 Hz
+  peqbank_set_limiter(x, LIMIT_LOOKAHEAD, -6.0f, 2.0f, LIMIT_RELEASE_MS);
+  peqbank_set_limiter(y, LIMIT_LOOKAHEAD, -6.0f, 2.0f, LIMIT_RELEASE_MS);
+  peqbank_setup(x, filters);
+  peqbank_setup(y, filters);
+
+  printf("Processing signal, saving the state at frame %d\n", half);
+  for (int i = 0; i < num_samples; i++) reference[i] = signal_in[i] / 32768.0f;
+  memcpy(restored, reference, num_samples * sizeof(float));
+  size_t size = peqbank_state_size(x);
+  void *state = malloc(size);
+  int loaded = -1;
+  for (int frame = 0; frame < num_frames;) {
+    if (frame == half) {
+      peqbank_save_state(x, state, size);
+      loaded = peqbank_load_state(y, state, size);
+    }
+    x->s_n = y->s_n = min(buffer_size, num_frames - frame);
+    float *block = &reference[frame * num_channels];
+    peqbank_callback_float(x, block, block);
+    if (frame >= half) {
+      block = &restored[frame * num_channels];
+      peqbank_callback_float(y, block, block);
+    }
+    frame += x->s_n;
+  }
+
+  int identical = memcmp(&reference[half * num_channels],
+                         &restored[half * num_channels],
+                         (num_samples - half * num_channels) * sizeof(float)) == 0;
+  printf("Snapshot of %d bytes, load %d, identical output %d\n", (int)size, loaded, identical);
+
+  free(signal_in);
+  free(reference);
+  free(restored);
+  free(state);
+  free_filters(filters);
+  peqbank_free(x);
+  peqbank_free(y);
+
+  return loaded == 0 && identical;
+}
+
+int test9() {
+  printf("Test9: response evaluator checked against the steady state of filtered sines\n");
+  int sampling_rate = 44100;
+  int buffer_size = 441;
+  int num_frames = sampling_rate;  // 1 sec per sine, the second half measured
+  float freqs[7] = {600, 1000, 2000, 3000, 4000, 6000, 10000};
+  int num_freqs = 7;
+
+  t_peqbank *x = peqbank_new(sampling_rate, 1, buffer_size);
+
+  if (!x) {
+    return -1;
+  }
+
+  printf("Setting up filter\n");
+  t_filter **filters = new_filters(4);           // same filters as test4
+  filters[0] = new_shelf(0, -12, 0, 100, 5000);  // -12 db between 100 and 5000 Hz
+  filters[1] = new_highpass(500, 0.5, 8);        // cut below 500 Hz
+  filters[2] = new_peq(3000, 0.5, -3, 12, 3);    // bump at 3000 Hz
+  filters[3] = new_peq(4000, 0.25, 0, -6, -3);   // slight cut at 4000 Hz
+  x->b_mode = FAST;
+  peqbank_setup(x, filters);
+
+  float mag_db[7], phase[7];
+  peqbank_response(x, freqs, num_freqs, mag_db, phase, NULL);
+
+  float *signal = (float *)malloc(num_frames * sizeof(float));
+  float max_mag_error = 0.0f, max_phase_error = 0.0f;
+  for (int k = 0; k < num_freqs; k++) {
+    double w = TWOPI * freqs[k] / sampling_rate;
+    for (int i = 0; i < num_frames; i++) signal[i] = 0.1f * (float)sin(w * i);
+    peqbank_clear(x);
+    for (int frame = 0; frame < num_frames; frame += buffer_size) {
+      peqbank_callback_float(x, &signal[frame], &signal[frame]);
+    }
+
+    // In-phase and quadrature parts of the output against the input sine
+    double re = 0, im = 0;
+    for (int i = num_frames / 2; i < num_frames; i++) {
+      re += signal[i] * sin(w * i);
+      im += signal[i] * cos(w * i);
+    }
+    float mag = (float)(20 * log10(sqrt(re * re + im * im) * 4 / num_frames / 0.1));
+    float dphase = (float)remainder(atan2(im, re) - phase[k], TWOPI);
+    printf("%6.0f Hz: %8.3f dB, %7.3f rad, evaluator %8.3f dB, %7.3f rad\n",
+           freqs[k],
+           mag,
+           atan2(im, re),
+           mag_db[k],
+           phase[k]);
+    max_mag_error = fmaxf(max_mag_error, fabsf(mag - mag_db[k]));
+    max_phase_error = fmaxf(max_phase_error, fabsf(dphase));
+  }
+  printf("Largest difference: %.4f dB, %.4f rad\n", max_mag_error, max_phase_error);
+
+  free(signal);
+  free_filters(filters);
+  peqbank_free(x);
+
+  return max_mag_error < 0.05f && max_phase_error < 0.01f;
+}
+
+// Level in dB of the second half of a sine of angular frequency w and amplitude 0.1, interleaved
+// in signal as channel ch of num_channels
+static float sine_level_db(
+    const float *signal, int num_frames, int num_channels, int ch, double w) {
+  double re = 0, im = 0;
+  for (int i = num_frames / 2; i < num_frames; i++) {
+    re += signal[i * num_channels + ch] * sin(w * i);
+    im += signal[i * num_channels + ch] * cos(w * i);
+  }
+  return (float)(20 * log10(sqrt(re * re + im * im) * 4 / num_frames / 0.1));
+}
+
+int test10() {
+  printf("Test10: linear-phase FIR checked against the IIR cascade on filtered sines\n");
+  int sampling_rate = 44100;
+  int num_channels = 2;  // stereo, one channel pair through one complex FFT
+  int buffer_size = 441;
+  int num_frames = sampling_rate;  // 1 sec per sine, the second half measured
+  float freqs[6] = {1000, 2000, 3000, 4000, 6000, 10000};
+  int num_freqs = 6;
+
+  t_peqbank *x = peqbank_new(sampling_rate, num_channels, buffer_size);
+
+  if (!x) {
+    return -1;
+  }
+
+  printf("Setting up filter\n");
+  t_filter **filters = new_filters(4);           // same filters as test4
+  filters[0] = new_shelf(0, -12, 0, 100, 5000);  // -12 db between 100 and 5000 Hz
+  filters[1] = new_highpass(500, 0.5, 8);        // cut below 500 Hz
+  filters[2] = new_peq(3000, 0.5, -3, 12, 3);    // bump at 3000 Hz
+  filters[3] = new_peq(4000, 0.25, 0, -6, -3);   // slight cut at 4000 Hz
+  x->b_mode = FAST;
+  peqbank_setup(x, filters);
+  t_peqbank_fir *f = peqbank_fir_new(x, 4095, 512);
+  if (!f) {
+    return -1;
+  }
+  printf("FIR of %d taps, latency %d frames\n", f->b_taps, peqbank_fir_latency(f));
+
+  int num_samples = num_frames * num_channels;
+  float *iir = (float *)malloc(num_samples * sizeof(float));
+  float *fir = (float *)malloc(num_samples * sizeof(float));
+  float max_error = 0.0f;
+  for (int k = 0; k < num_freqs; k++) {
+    double w = TWOPI * freqs[k] / sampling_rate;
+    for (int i = 0; i < num_samples; i++) iir[i] = 0.1f * (float)sin(w * (i / num_channels));
+    memcpy(fir, iir, num_samples * sizeof(float));
+    peqbank_clear(x);
+    peqbank_fir_clear(f);
+    for (int frame = 0; frame < num_frames; frame += buffer_size) {
+      peqbank_callback_float(x, &iir[frame * num_channels], &iir[frame * num_channels]);
+      peqbank_fir_callback_float(f, &fir[frame * num_channels], &fir[frame * num_channels]);
+    }
+
+    float iir_db = sine_level_db(iir, num_frames, num_channels, 0, w);
+    for (int ch = 0; ch < num_channels; ch++) {
+      float fir_db = sine_level_db(fir, num_frames, num_channels, ch, w);
+      max_error = fmaxf(max_error, fabsf(fir_db - iir_db));
+      if (ch == 0) printf("%6.0f Hz: IIR %8.3f dB, FIR %8.3f dB\n", freqs[k], iir_db, fir_db);
+    }
+  }
+  printf("Largest difference: %.4f dB\n", max_error);
+
+  free(iir);
+  free(fir);
+  peqbank_fir_free(f);
+  free_filters(filters);
+  peqbank_free(x);
+
+  return max_error < 0.05f;
+}
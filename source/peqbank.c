@@ -19,6 +19,12 @@
 
 #include "PeqBank/peqbank.h"
 
+#include <float.h>  // for FLT_MIN
+
+#ifdef _WIN32
+#include <windows.h>  // for QueryPerformanceCounter
+#endif
+
 float peqbank_pow10(float x) {
   return expf(LOG_10 * x);
 }
@@ -27,25 +33,56 @@ float peqbank_pow2(float x) {
   return expf(LOG_2 * x);
 }
 
+int64_t peqbank_clock_ns(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (int64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 void peqbank_allocmem(t_peqbank *x) {
   // alocate and initialize memory
   x->s_vec_in = (float **)malloc(x->b_channels * sizeof(float *));
   x->s_vec_out = (float **)malloc(x->b_channels * sizeof(float *));
   x->s_vec_bak = x->s_vec_out;
+  x->s_vec_fade = (float **)malloc(x->b_channels * sizeof(float *));
   for (int i = 0; i < x->b_channels; i++) {
     x->s_vec_in[i] = malloc(x->s_n * sizeof(float));
     x->s_vec_out[i] = malloc(x->s_n * sizeof(float));
+    x->s_vec_fade[i] = malloc(x->s_n * sizeof(float));
   }
-  x->coeff = (float *)malloc(x->b_max * NBCOEFF * sizeof(*x->coeff));
+  // Room for per-channel coefficients
+  int ncoeff = x->b_max * NBCOEFF * x->b_channels;
+  x->coeff = (float *)malloc(ncoeff * sizeof(*x->coeff));
   x->oldcoeff = x->coeff;
-  x->newcoeff = (float *)malloc(x->b_max * NBCOEFF * sizeof(*x->newcoeff));
-  x->freecoeff = (float *)malloc(x->b_max * NBCOEFF * sizeof(*x->freecoeff));
+  x->newcoeff = (float *)malloc(ncoeff * sizeof(*x->newcoeff));
+  x->freecoeff = (float *)malloc(ncoeff * sizeof(*x->freecoeff));
+  x->b_chdesign = (float *)malloc(ncoeff * sizeof(*x->b_chdesign));
   x->b_ym1 = (float *)malloc(x->b_max * x->b_channels * sizeof(*x->b_ym1));
   x->b_ym2 = (float *)malloc(x->b_max * x->b_channels * sizeof(*x->b_ym2));
   x->b_xm1 = (float *)malloc(x->b_max * x->b_channels * sizeof(*x->b_xm1));
   x->b_xm2 = (float *)malloc(x->b_max * x->b_channels * sizeof(*x->b_xm2));
+  x->b_settled = (int *)malloc(x->b_channels * sizeof(*x->b_settled));
+  x->b_meters = (t_peqbank_meter *)calloc(x->b_channels, sizeof(*x->b_meters));
+  x->b_dynamic_state =
+      (t_dynamic_state *)calloc(MAXELEM * x->b_channels, sizeof(*x->b_dynamic_state));
+  x->b_fade_coeff = (float *)malloc(ncoeff * sizeof(*x->b_fade_coeff));
+  x->b_fade_state = (float *)malloc(4 * x->b_max * x->b_channels * sizeof(*x->b_fade_state));
+  if (x->b_lookahead > 0) {
+    x->b_limit_delay = (float *)calloc(x->b_lookahead * x->b_channels, sizeof(float));
+  }
   if (x->coeff == NULL || x->newcoeff == NULL || x->freecoeff == NULL || x->b_ym1 == NULL ||
-      x->b_ym2 == NULL || x->b_xm1 == NULL || x->b_xm2 == NULL) {
+      x->b_ym2 == NULL || x->b_xm1 == NULL || x->b_xm2 == NULL || x->b_settled == NULL ||
+      x->b_fade_coeff == NULL || x->b_fade_state == NULL || x->b_chdesign == NULL ||
+      x->b_meters == NULL || x->b_dynamic_state == NULL ||
+      (x->b_lookahead > 0 && x->b_limit_delay == NULL)) {
     printf("Warning: not enough memory. Expect to crash soon.\n");
   }
 }
@@ -54,21 +91,33 @@ void peqbank_resize_buffer(t_peqbank *x, int buffer_size) {
   for (int i = 0; i < x->b_channels; i++) {
     free((char *)x->s_vec_in[i]);
     free((char *)x->s_vec_bak[i]);
+    free((char *)x->s_vec_fade[i]);
   }
   free((char *)x->s_vec_in);
   free((char *)x->s_vec_bak);
+  free((char *)x->s_vec_fade);
 
   x->s_n = buffer_size;
   x->s_vec_in = (float **)malloc(x->b_channels * sizeof(float *));
   x->s_vec_out = (float **)malloc(x->b_channels * sizeof(float *));
   x->s_vec_bak = x->s_vec_out;
+  x->s_vec_fade = (float **)malloc(x->b_channels * sizeof(float *));
   for (int i = 0; i < x->b_channels; i++) {
     x->s_vec_in[i] = malloc(x->s_n * sizeof(float));
     x->s_vec_out[i] = malloc(x->s_n * sizeof(float));
+    x->s_vec_fade[i] = malloc(x->s_n * sizeof(float));
   }
 }
 
+void peqbank_free_rate_sets(t_peqbank *x) {
+  if (x->b_rate_sets) free(x->b_rate_sets[0].coeff);
+  free(x->b_rate_sets);
+  x->b_rate_sets = NULL;
+  x->b_nrates = 0;
+}
+
 void peqbank_freemem(t_peqbank *x) {
+  peqbank_free_rate_sets(x);
   if (x->coeff != x->oldcoeff) free((char *)x->oldcoeff);
   free((char *)x->coeff);
   free((char *)x->newcoeff);
@@ -77,30 +126,53 @@ void peqbank_freemem(t_peqbank *x) {
   free((char *)x->b_ym2);
   free((char *)x->b_xm1);
   free((char *)x->b_xm2);
+  free((char *)x->b_settled);
+  free((char *)x->b_meters);
+  free((char *)x->b_dynamic_state);
+  free((char *)x->b_fade_coeff);
+  free((char *)x->b_chdesign);
+  free((char *)x->b_fade_state);
+  free((char *)x->b_limit_delay);
+  x->b_limit_delay = NULL;
   for (int i = 0; i < x->b_channels; i++) {
     free((char *)x->s_vec_in[i]);
     free((char *)x->s_vec_bak[i]);
+    free((char *)x->s_vec_fade[i]);
   }
   free((char *)x->s_vec_in);
   free((char *)x->s_vec_bak);
+  free((char *)x->s_vec_fade);
 }
 
-void peqbank_clear(t_peqbank *x) {
+// Puts the cascade at rest. The limiter is left alone: its delay line still holds output.
+static void clear_cascade(t_peqbank *x) {
   for (int i = 0; i < (x->b_max * x->b_channels); ++i) {
     x->b_ym1[i] = 0.0f;
     x->b_ym2[i] = 0.0f;
     x->b_xm1[i] = 0.0f;
     x->b_xm2[i] = 0.0f;
   }
+  for (int c = 0; c < x->b_channels; c++) x->b_settled[c] = 1;
+}
+
+void peqbank_clear(t_peqbank *x) {
+  clear_cascade(x);
+  peqbank_limiter_clear(x);
 }
 
 void peqbank_init(t_peqbank *x) {
-  for (int i = 0; i < x->b_max * NBCOEFF; ++i) {
+  for (int i = 0; i < x->b_max * NBCOEFF * x->b_channels; ++i) {
     x->coeff[i] = 0.0f;
     x->oldcoeff[i] = 0.0f;
     x->newcoeff[i] = 0.0f;
-    x->freecoeff[i] = 0.0f;
+    if (x->freecoeff) x->freecoeff[i] = 0.0f;  // lent to oldcoeff until the next perform
   }
+  x->b_ramp_left = 0;
+  x->b_nevents = 0;
+  x->b_fade_left = 0;
+  x->b_deferred = 0;
+  // A new list starts with its dynamic bands at rest
+  memset(x->b_dynamic_state, 0, MAXELEM * x->b_channels * sizeof(*x->b_dynamic_state));
   peqbank_clear(x);
 }
 
@@ -112,10 +184,43 @@ t_peqbank *peqbank_new(int sampling_rate, int num_channels, int buffer_size) {
   }
 
   x->b_mode = SMOOTH;  // Default
+  x->b_topology = TOPOLOGY_DF;
   x->b_max = MAXELEM;
   x->b_Fs = (float)sampling_rate;
+  x->b_nrates = 0;
+  x->b_rate_sets = NULL;
+  x->filters = NULL;
   x->b_channels = num_channels;
+  x->b_nbiquads = 0;
+  x->b_ndesigned = 0;
+  x->b_optimized = 0;
+  x->b_opt_tolerance = 0.0f;
+  x->b_opt_max_error = 0.0f;
+  x->b_headroom_auto = 0;
+  x->b_headroom = 0.0f;
+  x->b_flat = 0;
+  x->b_silence_thresh = SILENCE_THRESHOLD;
+  x->b_skipped = NOSKIP;
+  x->b_ramp = 0;
+  x->b_ramp_swap = 0;
+  x->b_block = 0;
+  x->b_generation = 0;
+  x->b_dynamic = 0;
+  x->b_control = DYNAMIC_CONTROL;
+  x->b_control_left = DYNAMIC_CONTROL;
+  x->b_chfilters = NULL;
+  x->b_fade_nbiquads = 0;
+  x->b_fade_per_channel = 0;
+  x->b_fade_len = 0;
+  x->b_defer_filters = NULL;
+  x->b_deferred = 0;
   x->s_n = buffer_size;
+  memset(&x->stats, 0, sizeof(x->stats));
+  x->b_meter = 0;
+  x->b_limit = LIMIT_OFF;
+  x->b_lookahead = 0;
+  x->b_limit_delay = NULL;
+  peqbank_set_limiter(x, LIMIT_OFF, LIMIT_THRESHOLD_DB, 0.0f, LIMIT_RELEASE_MS);
 
   peqbank_allocmem(x);
   peqbank_init(x);
@@ -123,6 +228,31 @@ t_peqbank *peqbank_new(int sampling_rate, int num_channels, int buffer_size) {
   return (x);
 }
 
+void peqbank_free(t_peqbank *x) {
+  peqbank_freemem(x);
+  free(x);
+}
+
+// Per-channel banks list their sections channel by channel
+static void print_channels(t_peqbank *x) {
+  float coeff[MAXELEM * NBCOEFF];
+  for (int ch = 0; ch < x->b_channels; ch++) {
+    int nbiquads = peqbank_channel_coeffs(x, ch, coeff);
+    int nfilters = 0;
+    while (x->b_chfilters[ch][nfilters]->type != NONE) nfilters++;
+    printf("Channel %2d | %d filters\n", ch, nfilters);
+    for (int c = 0; c < nbiquads * NBCOEFF; c += NBCOEFF) {
+      printf("          | Coeffs: [%f %f %f %f %f]\n",
+             coeff[c],
+             coeff[c + 1],
+             coeff[c + 2],
+             coeff[c + 3],
+             coeff[c + 4]);
+    }
+  }
+  printf("Number of biquads: %d per channel\n", x->b_nbiquads);
+}
+
 void peqbank_print_info(t_peqbank *x) {
   if (x->b_mode == SMOOTH) {
     printf("Smooth Mode: Coefficients linearly interpolated over one buffer\n");
@@ -132,13 +262,24 @@ void peqbank_print_info(t_peqbank *x) {
     printf("ERROR: object is in neither FAST mode nor SMOOTH mode!\n");
   }
 
+  if (x->b_topology == TOPOLOGY_SVF) {
+    printf("State-variable sections: parameters interpolated every %d frames\n", SVF_SUBBLOCK);
+  }
   printf("Audio sampling rate: %.0f Hz\n", x->b_Fs);
   printf("Number of audio channels: %d\n", x->b_channels);
   printf("Max number of biquads: %d\n", x->b_max);
+  if (x->b_headroom_auto) printf("Headroom compensation: %.2f dB\n", x->b_headroom);
+  if (x->b_chfilters) {
+    print_channels(x);
+    return;
+  }
 
+  // Once the optimizer has rewritten the cascade, sections no longer map to filters one to one
+  int optimized = x->b_optimized;
   int i = 0;
   int c = 0;
-  while (x->filters[i]->type != NONE) {
+  // Filters left out of a design that did not fit in b_max sections are not listed
+  while (x->filters[i]->type != NONE && c < x->b_ndesigned * NBCOEFF) {
     switch (x->filters[i]->type) {
       case SHELF: {
         t_shelf *s = x->filters[i]->filter;
@@ -159,12 +300,14 @@ void peqbank_print_info(t_peqbank *x) {
             s->freq_high,
             s->gain_high,
             s->freq_high);
-        printf("          | Coeffs: [%f %f %f %f %f]\n",
-               x->coeff[c],
-               x->coeff[c + 1],
-               x->coeff[c + 2],
-               x->coeff[c + 3],
-               x->coeff[c + 4]);
+        if (!optimized) {
+          printf("          | Coeffs: [%f %f %f %f %f]\n",
+                 x->coeff[c],
+                 x->coeff[c + 1],
+                 x->coeff[c + 2],
+                 x->coeff[c + 3],
+                 x->coeff[c + 4]);
+        }
         c += NBCOEFF;
         break;
       }
@@ -186,12 +329,45 @@ void peqbank_print_info(t_peqbank *x) {
             p->freq_peak,
             p->bandwidth,
             p->gain_bandwidth);
-        printf("          | Coeffs: [%f %f %f %f %f]\n",
-               x->coeff[c],
-               x->coeff[c + 1],
-               x->coeff[c + 2],
-               x->coeff[c + 3],
-               x->coeff[c + 4]);
+        if (!optimized) {
+          printf("          | Coeffs: [%f %f %f %f %f]\n",
+                 x->coeff[c],
+                 x->coeff[c + 1],
+                 x->coeff[c + 2],
+                 x->coeff[c + 3],
+                 x->coeff[c + 4]);
+        }
+        c += NBCOEFF;
+        break;
+      }
+      case DYNAMIC: {
+        t_dynamic *d = x->filters[i]->filter;
+        printf("Filter %2d | Dynamic EQ | Params: %.2f Hz, %.2f oct, %.2f dB, %.2f dBFS, %.2f, "
+               "%.2f dB, %.1f ms, %.1f ms\n",
+               i + 1,
+               d->freq,
+               d->bandwidth,
+               d->gain,
+               d->threshold,
+               d->ratio,
+               d->range,
+               d->attack,
+               d->release);
+        printf("          | i.e. peak of %.2f dB at %.2f Hz, moving by up to %.2f dB at ratio %.2f "
+               "above %.2f dBFS in the band\n",
+               d->gain,
+               d->freq,
+               d->range,
+               d->ratio,
+               d->threshold);
+        if (!optimized) {
+          printf("          | Coeffs: [%f %f %f %f %f]\n",
+                 x->coeff[c],
+                 x->coeff[c + 1],
+                 x->coeff[c + 2],
+                 x->coeff[c + 3],
+                 x->coeff[c + 4]);
+        }
         c += NBCOEFF;
         break;
       }
@@ -215,12 +391,14 @@ void peqbank_print_info(t_peqbank *x) {
                f->ripple,
                f->order);
         for (int j = 0; j < f->order / 2; j++) {
-          printf("          | Coeffs: [%f %f %f %f %f]\n",
-                 x->coeff[c],
-                 x->coeff[c + 1],
-                 x->coeff[c + 2],
-                 x->coeff[c + 3],
-                 x->coeff[c + 4]);
+          if (!optimized) {
+            printf("          | Coeffs: [%f %f %f %f %f]\n",
+                   x->coeff[c],
+                   x->coeff[c + 1],
+                   x->coeff[c + 2],
+                   x->coeff[c + 3],
+                   x->coeff[c + 4]);
+          }
           c += NBCOEFF;
         }
         break;
@@ -229,6 +407,18 @@ void peqbank_print_info(t_peqbank *x) {
     i++;
   }
   printf("Number of filters: %d\n", i);
+  if (optimized) {
+    printf("Optimized cascade: %d biquads instead of %d\n", x->b_nbiquads, x->b_ndesigned);
+    for (c = 0; c < x->b_nbiquads * NBCOEFF; c += NBCOEFF) {
+      printf("          | Coeffs: [%f %f %f %f %f]\n",
+             x->coeff[c],
+             x->coeff[c + 1],
+             x->coeff[c + 2],
+             x->coeff[c + 3],
+             x->coeff[c + 4]);
+    }
+  }
+  c = x->b_nbiquads * NBCOEFF;  // with the gain section headroom compensation may add
   printf("Number of biquads: %d\n", x->b_nbiquads);
   printf("Complexity per sample: %d multiplications, %d additions\n", c, c - x->b_nbiquads);
   printf("Complexity per second: %.0f multiplications, %.0f additions\n",
@@ -236,50 +426,63 @@ void peqbank_print_info(t_peqbank *x) {
          (c - 1) * x->b_Fs);
 }
 
-int do_peqbank_perform_fast(t_peqbank *x) {
-  int n = x->s_n;
+// FLUSH_TO_ZERO that also counts the values it flushed. The macro reads its argument through an
+// integer pointer, which is only safe on array elements, so the test is on the magnitude here.
+static float flush_state(t_peqbank *x, float v) {
+  float f = fabsf(v) < FLT_MIN ? 0.0f : v;
+  x->stats.denormal_flushes += (f != v);
+  return f;
+}
+
+typedef int (*t_cascade)(
+    t_peqbank *x, const float *, int, float *, float *, float *, float *, float **, int);
+
+// Runs a cascade of nbiquads biquads in place on the n first frames of vec, with the state layout
+// of b_xm1 and friends
+static int cascade(t_peqbank *x,
+                   const float *coeff,
+                   int nbiquads,
+                   float *b_xm1,
+                   float *b_xm2,
+                   float *b_ym1,
+                   float *b_ym2,
+                   float **vec,
+                   int n) {
   float a0, a1, a2, b1, b2;
 
   // msvc does not support C99 VLA, so stack allocate instead
-  float *xn = alloca(x->b_channels);
-  float *yn = alloca(x->b_channels);
-  float *xm2 = alloca(x->b_channels);
-  float *xm1 = alloca(x->b_channels);
-  float *ym2 = alloca(x->b_channels);
-  float *ym1 = alloca(x->b_channels);
-
-  // First copy input vector to output vector, we'll filter the output in-place
-  for (int c = 0; c < x->b_channels; c++) {
-    if (x->s_vec_out[c] != x->s_vec_in[c]) {
-      for (int i = 0; i < n; i++) x->s_vec_out[c][i] = x->s_vec_in[c][i];
-    }
-  }
+  float *xn = alloca(x->b_channels * sizeof(float));
+  float *yn = alloca(x->b_channels * sizeof(float));
+  float *xm2 = alloca(x->b_channels * sizeof(float));
+  float *xm1 = alloca(x->b_channels * sizeof(float));
+  float *ym2 = alloca(x->b_channels * sizeof(float));
+  float *ym1 = alloca(x->b_channels * sizeof(float));
 
   // Cascade of Biquads
   int k = 0, s = 0;
-  for (int j = 0; j < x->b_nbiquads * NBCOEFF; j += NBCOEFF) {
+  for (int j = 0; j < nbiquads * NBCOEFF; j += NBCOEFF) {
     for (int c = 0; c < x->b_channels; c++) {
-      xm2[c] = x->b_xm2[k * x->b_channels + c];
-      xm1[c] = x->b_xm1[k * x->b_channels + c];
-      ym2[c] = x->b_ym2[k * x->b_channels + c];
-      ym1[c] = x->b_ym1[k * x->b_channels + c];
+      xm2[c] = b_xm2[k * x->b_channels + c];
+      xm1[c] = b_xm1[k * x->b_channels + c];
+      ym2[c] = b_ym2[k * x->b_channels + c];
+      ym1[c] = b_ym1[k * x->b_channels + c];
     }
 
-    a0 = x->coeff[j];
-    a1 = x->coeff[j + 1];
-    a2 = x->coeff[j + 2];
-    b1 = x->coeff[j + 3];
-    b2 = x->coeff[j + 4];
+    a0 = coeff[j];
+    a1 = coeff[j + 1];
+    a2 = coeff[j + 2];
+    b1 = coeff[j + 3];
+    b2 = coeff[j + 4];
 
     for (int i = 0; i < n; i++) {
       for (int c = 0; c < x->b_channels; c++) {
-        xn[c] = x->s_vec_out[c][i];
+        xn[c] = vec[c][i];
       }
       for (int c = 0; c < x->b_channels; c++) {
         yn[c] = (a0 * xn[c]) + (a1 * xm1[c]) + (a2 * xm2[c]) - (b1 * ym1[c]) - (b2 * ym2[c]);
       }
       for (int c = 0; c < x->b_channels; c++) {
-        x->s_vec_out[c][i] = yn[c];
+        vec[c][i] = yn[c];
       }
       for (int c = 0; c < x->b_channels; c++) {
         xm2[c] = xm1[c];
@@ -290,10 +493,10 @@ int do_peqbank_perform_fast(t_peqbank *x) {
       s++;
     }
     for (int c = 0; c < x->b_channels; c++) {
-      x->b_xm2[k * x->b_channels + c] = FLUSH_TO_ZERO(xm2[c]);
-      x->b_xm1[k * x->b_channels + c] = FLUSH_TO_ZERO(xm1[c]);
-      x->b_ym2[k * x->b_channels + c] = FLUSH_TO_ZERO(ym2[c]);
-      x->b_ym1[k * x->b_channels + c] = FLUSH_TO_ZERO(ym1[c]);
+      b_xm2[k * x->b_channels + c] = flush_state(x, xm2[c]);
+      b_xm1[k * x->b_channels + c] = flush_state(x, xm1[c]);
+      b_ym2[k * x->b_channels + c] = flush_state(x, ym2[c]);
+      b_ym1[k * x->b_channels + c] = flush_state(x, ym1[c]);
     }
     k++;
   }  // cascade loop
@@ -302,18 +505,319 @@ int do_peqbank_perform_fast(t_peqbank *x) {
   return s / k;
 }
 
+// Same with per-channel coefficients. Each coefficient is a vector over the channels, so the inner
+// channel loop stays branch-free.
+static int cascade_channels(t_peqbank *x,
+                            const float *coeff,
+                            int nbiquads,
+                            float *b_xm1,
+                            float *b_xm2,
+                            float *b_ym1,
+                            float *b_ym2,
+                            float **vec,
+                            int n) {
+  int nch = x->b_channels;
+
+  // msvc does not support C99 VLA, so stack allocate instead
+  float *xn = alloca(nch * sizeof(float));
+  float *yn = alloca(nch * sizeof(float));
+  float *xm2 = alloca(nch * sizeof(float));
+  float *xm1 = alloca(nch * sizeof(float));
+  float *ym2 = alloca(nch * sizeof(float));
+  float *ym1 = alloca(nch * sizeof(float));
+
+  for (int k = 0; k < nbiquads; k++) {
+    const float *a0 = &coeff[k * NBCOEFF * nch];
+    const float *a1 = a0 + nch;
+    const float *a2 = a1 + nch;
+    const float *b1 = a2 + nch;
+    const float *b2 = b1 + nch;
+    for (int c = 0; c < nch; c++) {
+      xm2[c] = b_xm2[k * nch + c];
+      xm1[c] = b_xm1[k * nch + c];
+      ym2[c] = b_ym2[k * nch + c];
+      ym1[c] = b_ym1[k * nch + c];
+    }
+
+    for (int i = 0; i < n; i++) {
+      for (int c = 0; c < nch; c++) {
+        xn[c] = vec[c][i];
+      }
+      for (int c = 0; c < nch; c++) {
+        yn[c] = (a0[c] * xn[c]) + (a1[c] * xm1[c]) + (a2[c] * xm2[c]) - (b1[c] * ym1[c]) -
+                (b2[c] * ym2[c]);
+      }
+      for (int c = 0; c < nch; c++) {
+        vec[c][i] = yn[c];
+      }
+      for (int c = 0; c < nch; c++) {
+        xm2[c] = xm1[c];
+        xm1[c] = xn[c];
+        ym2[c] = ym1[c];
+        ym1[c] = yn[c];
+      }
+    }
+    for (int c = 0; c < nch; c++) {
+      b_xm2[k * nch + c] = flush_state(x, xm2[c]);
+      b_xm1[k * nch + c] = flush_state(x, xm1[c]);
+      b_ym2[k * nch + c] = flush_state(x, ym2[c]);
+      b_ym1[k * nch + c] = flush_state(x, ym1[c]);
+    }
+  }  // cascade loop
+
+  return nbiquads > 0 ? n : 0;
+}
+
+// State-variable parameters [g, k, m0, m1, m2] of the biquad whose coefficients are c[0],
+// c[stride], ... c[4 * stride]. The section is Simper's trapezoidal SVF, whose output is
+// m0 * v0 + m1 * v1 + m2 * v2, and whose denominator matches the biquad's when
+// g^2 = (1 + b1 + b2) / (1 - b1 + b2): both are positive for a stable section.
+static void svf_from_biquad(const float *c, int stride, float *p) {
+  double a0 = c[0], a1 = c[stride], a2 = c[2 * stride], b1 = c[3 * stride], b2 = c[4 * stride];
+  double s = fmax(1.0 + b1 + b2, 1e-12);  // 4 g^2 / d0, with d0 = 1 + g k + g^2
+  double t = fmax(1.0 - b1 + b2, 1e-12);  // 4 / d0
+  double g = sqrt(s / t);
+  double k = 2.0 * (1.0 - b2) / (g * t);
+  double m0 = (a0 - a1 + a2) / t;
+  p[0] = (float)g;
+  p[1] = (float)k;
+  p[2] = (float)m0;
+  p[3] = (float)(2.0 * (a0 - a2) / (g * t) - m0 * k);
+  p[4] = (float)((a0 + a1 + a2) / s - m0);
+}
+
+// Inverse of svf_from_biquad
+static void svf_to_biquad(const float *p, float *c, int stride) {
+  double g = p[0], k = p[1], m0 = p[2], m1 = p[3], m2 = p[4];
+  double g2 = g * g;
+  double d0 = 1.0 + g * k + g2;
+  c[0] = (float)((m0 * d0 + m1 * g + m2 * g2) / d0);
+  c[stride] = (float)(2.0 * (m0 * (g2 - 1.0) + m2 * g2) / d0);
+  c[2 * stride] = (float)((m0 * (1.0 - g * k + g2) - m1 * g + m2 * g2) / d0);
+  c[3 * stride] = (float)(2.0 * (g2 - 1.0) / d0);
+  c[4 * stride] = (float)((1.0 - g * k + g2) / d0);
+}
+
+// Runs a cascade of state-variable sections in place on the n first frames of vec, with the
+// integrators in ic1eq and ic2eq. The parameters of the sections move linearly from those of
+// from to those of to over left frames, of which these are the first n, and are updated every
+// SVF_SUBBLOCK frames. When reached is not NULL, the biquads reached at frame n are written there,
+// in the layout of from.
+static int svf_cascade(t_peqbank *x,
+                       const float *from,
+                       const float *to,
+                       int per_channel,
+                       int nbiquads,
+                       float *ic1eq,
+                       float *ic2eq,
+                       float **vec,
+                       int n,
+                       int left,
+                       float *reached) {
+  int nch = x->b_channels;
+  int stride = per_channel ? nch : 1;
+  int sub = from == to ? n : SVF_SUBBLOCK;
+  float p0[NBCOEFF], p1[NBCOEFF], p[NBCOEFF];
+
+  for (int k = 0; k < nbiquads; k++) {
+    for (int c = 0; c < nch; c++) {
+      int base = per_channel ? k * NBCOEFF * nch + c : k * NBCOEFF;
+      if (per_channel || c == 0) {
+        svf_from_biquad(&from[base], stride, p0);
+        if (from != to) svf_from_biquad(&to[base], stride, p1);
+      }
+      float s1 = ic1eq[k * nch + c];
+      float s2 = ic2eq[k * nch + c];
+      float *v = vec[c];
+
+      for (int i = 0; i < n; i += sub) {
+        int end = min(i + sub, n);
+        float pos = from == to ? 0.0f : (float)i / left;
+        for (int j = 0; j < NBCOEFF; j++) p[j] = from == to ? p0[j] : p0[j] + (p1[j] - p0[j]) * pos;
+        float a1 = 1.0f / (1.0f + p[0] * (p[0] + p[1]));
+        float a2 = p[0] * a1;
+        float a3 = p[0] * a2;
+        for (int t = i; t < end; t++) {
+          float v0 = v[t];
+          float v3 = v0 - s2;
+          float v1 = a1 * s1 + a2 * v3;
+          float v2 = s2 + a2 * s1 + a3 * v3;
+          s1 = 2.0f * v1 - s1;
+          s2 = 2.0f * v2 - s2;
+          v[t] = p[2] * v0 + p[3] * v1 + p[4] * v2;
+        }
+      }
+      ic1eq[k * nch + c] = flush_state(x, s1);
+      ic2eq[k * nch + c] = flush_state(x, s2);
+
+      if (reached && (per_channel || c == nch - 1)) {
+        for (int j = 0; j < NBCOEFF; j++) p[j] = p0[j] + (p1[j] - p0[j]) * ((float)n / left);
+        svf_to_biquad(p, &reached[base], stride);
+      }
+    }
+  }
+
+  return nbiquads > 0 ? n : 0;
+}
+
+// svf_cascade without ramp, as a t_cascade. The y state is not used.
+static int svf_shared(t_peqbank *x,
+                      const float *coeff,
+                      int nbiquads,
+                      float *b_xm1,
+                      float *b_xm2,
+                      float *b_ym1,
+                      float *b_ym2,
+                      float **vec,
+                      int n) {
+  (void)b_ym1;
+  (void)b_ym2;
+  return svf_cascade(x, coeff, coeff, 0, nbiquads, b_xm1, b_xm2, vec, n, n, NULL);
+}
+
+static int svf_channels(t_peqbank *x,
+                        const float *coeff,
+                        int nbiquads,
+                        float *b_xm1,
+                        float *b_xm2,
+                        float *b_ym1,
+                        float *b_ym2,
+                        float **vec,
+                        int n) {
+  (void)b_ym1;
+  (void)b_ym2;
+  return svf_cascade(x, coeff, coeff, 1, nbiquads, b_xm1, b_xm2, vec, n, n, NULL);
+}
+
+// Kernel running a cascade of the given layout in the current topology
+static t_cascade kernel(t_peqbank *x, int per_channel) {
+  if (x->b_topology == TOPOLOGY_SVF) return per_channel ? svf_channels : svf_shared;
+  return per_channel ? cascade_channels : cascade;
+}
+
+int do_peqbank_perform_fast(t_peqbank *x) {
+  int n = x->s_n;
+
+  // First copy input vector to output vector, we'll filter the output in-place
+  for (int c = 0; c < x->b_channels; c++) {
+    if (x->s_vec_out[c] != x->s_vec_in[c]) {
+      for (int i = 0; i < n; i++) x->s_vec_out[c][i] = x->s_vec_in[c][i];
+    }
+  }
+
+  t_cascade run = kernel(x, x->b_chfilters != NULL);
+  return run(x, x->coeff, x->b_nbiquads, x->b_xm1, x->b_xm2, x->b_ym1, x->b_ym2, x->s_vec_out, n);
+}
+
 int peqbank_perform_fast(t_peqbank *x) {
   int k = do_peqbank_perform_fast(x);
 
   // We still have to shuffle the coeff pointers around.
   if (x->coeff != x->oldcoeff) {
-    if (x->freecoeff != 0) printf("Disaster (fast)! freecoeff should be zero now!\n");
+    if (x->freecoeff != 0) x->stats.swap_errors++;  // freecoeff should be zero now
     x->freecoeff = x->oldcoeff;
     x->oldcoeff = x->coeff;
   }
+  x->b_ramp_left = 0;
   return k;
 }
 
+// Runs perform on frames [start, start + len) of the current block
+static int perform_range(t_peqbank *x, int start, int len, int (*perform)(t_peqbank *)) {
+  int n = x->s_n;
+  int block = x->b_block;
+  int in_place = x->s_vec_out == x->s_vec_in;
+
+  for (int c = 0; c < x->b_channels; c++) {
+    x->s_vec_in[c] += start;
+    if (!in_place) x->s_vec_out[c] += start;
+  }
+  if (block == 0) x->b_block = n;
+  x->s_n = len;
+  int k = perform(x);
+  x->s_n = n;
+  x->b_block = block;
+  for (int c = 0; c < x->b_channels; c++) {
+    x->s_vec_in[c] -= start;
+    if (!in_place) x->s_vec_out[c] -= start;
+  }
+  return k;
+}
+
+// Starts a ramp towards the coefficients last swapped in, unless it is already under way
+static void ramp_begin(t_peqbank *x, int block) {
+  if (x->b_ramp_left > 0 && x->b_ramp_swap == x->b_generation) return;
+  x->b_ramp_left = x->b_ramp > 0 ? x->b_ramp : block;
+  x->b_ramp_swap = x->b_generation;
+}
+
+// Ends the interpolation of n frames towards mycoeff
+static void ramp_end(t_peqbank *x, float *mycoeff, int n) {
+  x->b_ramp_left -= n;
+  if (x->b_ramp_left == 0) {
+    if (x->freecoeff != 0) x->stats.swap_errors++;  // freecoeff should be zero now
+    x->freecoeff = x->oldcoeff;
+    x->oldcoeff = mycoeff;
+  }
+
+  // The ramp ended inside this block: finish it with the new coefficients
+  if (n < x->s_n) perform_range(x, n, x->s_n - n, do_peqbank_perform_fast);
+}
+
+// Interpolating cascade for per-channel coefficients, on the n first frames of s_vec_out
+static int smooth_channels(t_peqbank *x, const float *mycoeff, int n, float rate, int partial) {
+  int nch = x->b_channels;
+  int nc = NBCOEFF * nch;
+
+  // msvc does not support C99 VLA, so stack allocate instead
+  float *a = alloca(nc * sizeof(float));
+  float *inc = alloca(nc * sizeof(float));
+  float *xn = alloca(nch * sizeof(float));
+  float *yn = alloca(nch * sizeof(float));
+  float *xm2 = alloca(nch * sizeof(float));
+  float *xm1 = alloca(nch * sizeof(float));
+  float *ym2 = alloca(nch * sizeof(float));
+  float *ym1 = alloca(nch * sizeof(float));
+
+  for (int k = 0; k < x->b_nbiquads; k++) {
+    float *old = &x->oldcoeff[k * nc];
+    for (int j = 0; j < nc; j++) {
+      a[j] = old[j];
+      inc[j] = (mycoeff[k * nc + j] - old[j]) * rate;
+    }
+    for (int c = 0; c < nch; c++) {
+      xm2[c] = x->b_xm2[k * nch + c];
+      xm1[c] = x->b_xm1[k * nch + c];
+      ym2[c] = x->b_ym2[k * nch + c];
+      ym1[c] = x->b_ym1[k * nch + c];
+    }
+
+    for (int i = 0; i < n; i++) {
+      for (int c = 0; c < nch; c++) {
+        xn[c] = x->s_vec_out[c][i];
+        yn[c] = (a[c] * xn[c]) + (a[nch + c] * xm1[c]) + (a[2 * nch + c] * xm2[c]) -
+                (a[3 * nch + c] * ym1[c]) - (a[4 * nch + c] * ym2[c]);
+        x->s_vec_out[c][i] = yn[c];
+        xm2[c] = xm1[c];
+        xm1[c] = xn[c];
+        ym2[c] = ym1[c];
+        ym1[c] = yn[c];
+      }
+      for (int j = 0; j < nc; j++) a[j] += inc[j];
+    }
+
+    for (int c = 0; c < nch; c++) {
+      x->b_xm2[k * nch + c] = flush_state(x, xm2[c]);
+      x->b_xm1[k * nch + c] = flush_state(x, xm1[c]);
+      x->b_ym2[k * nch + c] = flush_state(x, ym2[c]);
+      x->b_ym1[k * nch + c] = flush_state(x, ym1[c]);
+    }
+    if (partial) memcpy(old, a, nc * sizeof(float));
+  }  // cascade loop
+
+  return x->b_nbiquads > 0 ? n : 0;
+}
+
 int peqbank_perform_smooth(t_peqbank *x) {
   int n = x->s_n;
 
@@ -322,16 +826,21 @@ int peqbank_perform_smooth(t_peqbank *x) {
     // Coefficients haven't changed, so no need to interpolate
     return do_peqbank_perform_fast(x);
   } else {
-    // Biquad with linear interpolation: smooth-biquad~
-    float rate = 1.0f / n;
+    // Biquad with linear interpolation: smooth-biquad~. A ramp longer than the block continues in
+    // the next one, from the coefficients reached here, which are saved in oldcoeff.
+    ramp_begin(x, x->b_block > 0 ? x->b_block : n);  // one buffer is the whole callback
+    int left = x->b_ramp_left;
+    int partial = n < left;
+    if (n > left) n = left;
+    float rate = 1.0f / left;
 
     // msvc does not support C99 VLA, so stack allocate instead
-    float *i0 = alloca(x->b_channels);
-    float *i1 = alloca(x->b_channels);
-    float *i2 = alloca(x->b_channels);
-    float *i3 = alloca(x->b_channels);
-    float *y0 = alloca(x->b_channels);
-    float *y1 = alloca(x->b_channels);
+    float *i0 = alloca(x->b_channels * sizeof(float));
+    float *i1 = alloca(x->b_channels * sizeof(float));
+    float *i2 = alloca(x->b_channels * sizeof(float));
+    float *i3 = alloca(x->b_channels * sizeof(float));
+    float *y0 = alloca(x->b_channels * sizeof(float));
+    float *y1 = alloca(x->b_channels * sizeof(float));
 
     float a0, a1, a2, b1, b2;
     float a0inc, a1inc, a2inc, b1inc, b2inc;
@@ -343,6 +852,27 @@ int peqbank_perform_smooth(t_peqbank *x) {
       }
     }
 
+    if (x->b_topology == TOPOLOGY_SVF) {
+      int k = svf_cascade(x,
+                          x->oldcoeff,
+                          mycoeff,
+                          x->b_chfilters != NULL,
+                          x->b_nbiquads,
+                          x->b_xm1,
+                          x->b_xm2,
+                          x->s_vec_out,
+                          n,
+                          left,
+                          partial ? x->oldcoeff : NULL);
+      ramp_end(x, mycoeff, n);
+      return k;
+    }
+    if (x->b_chfilters) {
+      int k = smooth_channels(x, mycoeff, n, rate, partial);
+      ramp_end(x, mycoeff, n);
+      return k;
+    }
+
     //  Cascade of Biquads
     int k = 0, s = 0;
     for (int j = 0; j < x->b_nbiquads * NBCOEFF; j += NBCOEFF) {
@@ -367,7 +897,8 @@ int peqbank_perform_smooth(t_peqbank *x) {
       b1inc = (mycoeff[j + 3] - b1) * rate;
       b2inc = (mycoeff[j + 4] - b2) * rate;
 
-      for (int i = 0; i < n; i += 4) {
+      int i = 0;
+      for (; i + 4 <= n; i += 4) {
         for (int c = 0; c < x->b_channels; c++) {
           x->s_vec_out[c][i] = y0[c] = (a0 * (i0[c] = x->s_vec_out[c][i])) + (a1 * i3[c]) +
                                        (a2 * i2[c]) - (b1 * y1[c]) - (b2 * y0[c]);
@@ -408,67 +939,639 @@ int peqbank_perform_smooth(t_peqbank *x) {
         s += 4;
       }  // Interpolation loop
 
+      // Remaining 1 to 3 samples, keeping i2, i3, y0, y1 as x[n-2], x[n-1], y[n-2], y[n-1]
+      for (; i < n; i++) {
+        for (int c = 0; c < x->b_channels; c++) {
+          i0[c] = x->s_vec_out[c][i];
+          x->s_vec_out[c][i] = (a0 * i0[c]) + (a1 * i3[c]) + (a2 * i2[c]) - (b1 * y1[c]) -
+                               (b2 * y0[c]);
+          i2[c] = i3[c];
+          i3[c] = i0[c];
+          y0[c] = y1[c];
+          y1[c] = x->s_vec_out[c][i];
+        }
+        a1 += a1inc;
+        a2 += a2inc;
+        a0 += a0inc;
+        b1 += b1inc;
+        b2 += b2inc;
+        s++;
+      }
+
       for (int c = 0; c < x->b_channels; c++) {
-        x->b_xm2[k * x->b_channels + c] = FLUSH_TO_ZERO(i2[c]);
-        x->b_xm1[k * x->b_channels + c] = FLUSH_TO_ZERO(i3[c]);
-        x->b_ym2[k * x->b_channels + c] = FLUSH_TO_ZERO(y0[c]);
-        x->b_ym1[k * x->b_channels + c] = FLUSH_TO_ZERO(y1[c]);
+        x->b_xm2[k * x->b_channels + c] = flush_state(x, i2[c]);
+        x->b_xm1[k * x->b_channels + c] = flush_state(x, i3[c]);
+        x->b_ym2[k * x->b_channels + c] = flush_state(x, y0[c]);
+        x->b_ym1[k * x->b_channels + c] = flush_state(x, y1[c]);
+      }
+      if (partial) {
+        x->oldcoeff[j] = a0;
+        x->oldcoeff[j + 1] = a1;
+        x->oldcoeff[j + 2] = a2;
+        x->oldcoeff[j + 3] = b1;
+        x->oldcoeff[j + 4] = b2;
       }
 
       k++;
     }  // cascade loop
 
-    if (x->freecoeff != 0) printf("Disaster (smooth)! freecoeff should be zero now!\n");
-    x->freecoeff = x->oldcoeff;
-    x->oldcoeff = mycoeff;
+    ramp_end(x, mycoeff, n);
 
     if (k == 0) return 0;
     return s / k;
   }
 }
 
+static int channel_is_silent(const float *v, int n) {
+  for (int i = 0; i < n; i++) {
+    if (v[i] != 0.0f) return 0;
+  }
+  return 1;
+}
+
+// A silent channel has settled once every section's state has decayed below the threshold. Its
+// state is then zeroed, so the cascade would produce exact zeros from here on.
+static void track_tail(t_peqbank *x, const int *silent) {
+  for (int c = 0; c < x->b_channels; c++) {
+    int settled = silent[c];
+    for (int k = 0; k < x->b_nbiquads && settled; k++) {
+      int idx = k * x->b_channels + c;
+      settled = fabsf(x->b_xm1[idx]) < x->b_silence_thresh &&
+                fabsf(x->b_xm2[idx]) < x->b_silence_thresh &&
+                fabsf(x->b_ym1[idx]) < x->b_silence_thresh &&
+                fabsf(x->b_ym2[idx]) < x->b_silence_thresh;
+    }
+    if (settled && !x->b_settled[c]) {
+      for (int k = 0; k < x->b_max; k++) {
+        int idx = k * x->b_channels + c;
+        x->b_xm1[idx] = x->b_xm2[idx] = x->b_ym1[idx] = x->b_ym2[idx] = 0.0f;
+      }
+    }
+    x->b_settled[c] = settled;
+  }
+}
+
+static int perform_block(t_peqbank *x) {
+  int n = x->s_n;
+  int tracking = x->b_silence_thresh > 0.0f;
+  int *silent = alloca(x->b_channels * sizeof(int));
+  int was_flat = x->b_skipped == SKIP_FLAT;
+
+  x->b_skipped = NOSKIP;
+
+  // Fast paths only apply while no coefficient change or crossfade is pending
+  if (x->coeff == x->oldcoeff && x->b_fade_left == 0) {
+    if (x->b_flat) {
+      // The state stops following the input once bypassed: leave it at rest, as a settled tail
+      if (!was_flat) clear_cascade(x);
+      for (int c = 0; c < x->b_channels; c++) {
+        if (x->s_vec_out[c] != x->s_vec_in[c]) {
+          memcpy(x->s_vec_out[c], x->s_vec_in[c], n * sizeof(float));
+        }
+      }
+      x->b_skipped = SKIP_FLAT;
+      return n;
+    }
+
+    int skip = tracking;
+    for (int c = 0; c < x->b_channels; c++) {
+      silent[c] = tracking && channel_is_silent(x->s_vec_in[c], n);
+      skip = skip && silent[c] && x->b_settled[c];
+    }
+    if (skip) {
+      for (int c = 0; c < x->b_channels; c++) {
+        if (x->s_vec_out[c] != x->s_vec_in[c]) memset(x->s_vec_out[c], 0, n * sizeof(float));
+      }
+      x->b_skipped = SKIP_SILENT;
+      return n;
+    }
+  } else {
+    for (int c = 0; c < x->b_channels; c++) {
+      silent[c] = tracking && channel_is_silent(x->s_vec_in[c], n);
+    }
+  }
+
+  // The cascade being faded out runs on the input first, in case filtering is in place
+  int m = x->b_fade_left < n ? x->b_fade_left : n;
+  if (m > 0) {
+    int nb = x->b_max * x->b_channels;
+    float *st = x->b_fade_state;
+    for (int c = 0; c < x->b_channels; c++) {
+      memcpy(x->s_vec_fade[c], x->s_vec_in[c], m * sizeof(float));
+    }
+    t_cascade run = kernel(x, x->b_fade_per_channel);
+    run(x,
+        x->b_fade_coeff,
+        x->b_fade_nbiquads,
+        st,
+        st + nb,
+        st + 2 * nb,
+        st + 3 * nb,
+        x->s_vec_fade,
+        m);
+  }
+
+  int k = 0;
+  if (x->b_mode == FAST) {
+    k = peqbank_perform_fast(x);
+  } else {
+    k = peqbank_perform_smooth(x);
+  }
+
+  if (m > 0) {
+    float step = 1.0f / x->b_fade_len;
+    int pos = x->b_fade_len - x->b_fade_left;
+    for (int c = 0; c < x->b_channels; c++) {
+      for (int i = 0; i < m; i++) {
+        float old = x->s_vec_fade[c][i];
+        x->s_vec_out[c][i] = old + (x->s_vec_out[c][i] - old) * ((pos + i) * step);
+      }
+    }
+    x->b_fade_left -= m;
+  }
+
+  if (tracking) track_tail(x, silent);
+  return k;
+}
+
+static int design(t_peqbank *x, int *ndesigned, int *flat, int *optimized);
+
+// Makes the design in x->newcoeff active. When its sections do not line up with those of the
+// running cascade, which has nbiquads sections in the given layout, SMOOTH mode crossfades from
+// that cascade instead of ramping.
+static void activate(t_peqbank *x, int nbiquads, int per_channel, int relayout, int block) {
+  if (x->b_mode == FAST || !relayout) {
+    swap_in_new_coeffs(x);
+    return;
+  }
+  // With a change still pending, the running cascade is the one in oldcoeff
+  float *running = x->coeff != x->oldcoeff ? x->oldcoeff : x->coeff;
+  memcpy(x->b_fade_coeff, running, x->b_max * NBCOEFF * x->b_channels * sizeof(*x->coeff));
+  swap_in_new_coeffs(x);
+
+  // Set the running cascade aside and start the new one from rest at its final coefficients. No
+  // crossfade is in progress here: changes made during one wait for its end (see defer).
+  int nb = x->b_max * x->b_channels;
+  memcpy(x->b_fade_state, x->b_xm1, nb * sizeof(float));
+  memcpy(x->b_fade_state + nb, x->b_xm2, nb * sizeof(float));
+  memcpy(x->b_fade_state + 2 * nb, x->b_ym1, nb * sizeof(float));
+  memcpy(x->b_fade_state + 3 * nb, x->b_ym2, nb * sizeof(float));
+  x->b_fade_nbiquads = nbiquads;
+  x->b_fade_per_channel = per_channel;
+  x->b_fade_len = x->b_fade_left = x->b_ramp > 0 ? x->b_ramp : block;
+  clear_cascade(x);
+
+  if (x->freecoeff != 0) x->stats.swap_errors++;  // freecoeff should be zero now
+  x->freecoeff = x->oldcoeff;
+  x->oldcoeff = x->coeff;
+  x->b_ramp_left = 0;
+}
+
+// A change made during a crossfade waits for its end. Overwriting the faded cascade would drop
+// the mix in progress and click; filters is NULL for a redesign of the current ones.
+static int defer(t_peqbank *x, t_filter **filters) {
+  if (x->b_mode == FAST || x->b_fade_left == 0) return 0;
+  if (filters) x->b_defer_filters = filters;
+  x->b_deferred = 1;
+  return 1;
+}
+
+static void set_filters(t_peqbank *x, t_filter **filters, int block) {
+  if (defer(x, filters)) return;
+  int nbiquads = x->b_nbiquads;
+  int per_channel = x->b_chfilters != NULL;
+  int optimized = x->b_optimized;
+  x->filters = filters;
+  x->b_chfilters = NULL;
+  x->b_nrates = 0;  // precomputed for the previous filters
+  x->b_nbiquads = design(x, &x->b_ndesigned, &x->b_flat, &x->b_optimized);
+  int relayout = x->b_nbiquads != nbiquads || per_channel || optimized || x->b_optimized;
+  activate(x, nbiquads, per_channel, relayout, block);
+}
+
+void peqbank_set_filters(t_peqbank *x, t_filter **filters) {
+  set_filters(x, filters, x->s_n);
+}
+
+static void apply_event(t_peqbank *x, const t_peqbank_event *e, int block) {
+  set_filters(x, e->filters, block);
+  if (x->b_mode == SMOOTH && x->coeff != x->oldcoeff) ramp_begin(x, block);
+}
+
+// Installs the change deferred by the crossfade that just ended, as an event at this frame
+static void apply_deferred(t_peqbank *x, int block) {
+  t_filter **filters = x->b_defer_filters;
+  x->b_deferred = 0;
+  x->b_defer_filters = NULL;
+  if (filters) {
+    set_filters(x, filters, block);
+  } else {
+    peqbank_set_sample_rate(x, (int)x->b_Fs);  // reuses a precomputed set if there is one
+  }
+  if (x->b_mode == SMOOTH && x->coeff != x->oldcoeff) ramp_begin(x, block);
+}
+
+// State of the dynamic band at position i of a list (channel -1 for the shared one)
+static t_dynamic_state *dynamic_state(t_peqbank *x, int channel, int i) {
+  return &x->b_dynamic_state[(channel < 0 ? 0 : channel) * MAXELEM + i];
+}
+
+static void dynamic_prepare(const t_dynamic *d, t_dynamic_state *s, float fs) {
+  // Bandpass with 0 dB gain at the center, over the bandwidth of the band
+  float w0 = TWOPI * d->freq / fs;
+  float alpha = sinf(w0) * sinhf(LOG_22 * d->bandwidth * w0 / sinf(w0));
+  float a0 = 1.0f + alpha;
+  s->sc[0] = alpha / a0;
+  s->sc[1] = 0.0f;
+  s->sc[2] = -alpha / a0;
+  s->sc[3] = -2.0f * cosf(w0) / a0;
+  s->sc[4] = (1.0f - alpha) / a0;
+  s->attack_coeff = d->attack > 0.0f ? expf(-1000.0f / (d->attack * fs)) : 0.0f;
+  s->release_coeff = d->release > 0.0f ? expf(-1000.0f / (d->release * fs)) : 0.0f;
+  s->fs = fs;
+}
+
+// Runs the sidechains of the dynamic bands of a list over len input frames from start. A shared
+// list (channel -1) listens to the mean of the channels.
+static void dynamic_detect(t_peqbank *x, t_filter **filters, int channel, int start, int len) {
+  int nch = x->b_channels;
+  float scale = 1.0f / nch;
+  for (int i = 0; i < MAXELEM && filters[i]->type != NONE; i++) {
+    if (filters[i]->type != DYNAMIC) continue;
+    const t_dynamic *d = filters[i]->filter;
+    t_dynamic_state *s = dynamic_state(x, channel, i);
+    if (s->fs != x->b_Fs) dynamic_prepare(d, s, x->b_Fs);
+
+    const float *sc = s->sc;
+    float xm1 = s->sc_state[0], xm2 = s->sc_state[1], ym1 = s->sc_state[2], ym2 = s->sc_state[3];
+    float env = s->env;
+    for (int n = start; n < start + len; n++) {
+      float in = 0.0f;
+      if (channel >= 0) {
+        in = x->s_vec_in[channel][n];
+      } else {
+        for (int c = 0; c < nch; c++) in += x->s_vec_in[c][n];
+        in *= scale;
+      }
+      float y = sc[0] * in + sc[1] * xm1 + sc[2] * xm2 - sc[3] * ym1 - sc[4] * ym2;
+      xm2 = xm1;
+      xm1 = in;
+      ym2 = ym1;
+      ym1 = y;
+      float r = fabsf(y);
+      env = r + (r > env ? s->attack_coeff : s->release_coeff) * (env - r);
+    }
+    // Flushed by magnitude, as FLUSH_TO_ZERO must not read scalars through its integer pointer
+    s->sc_state[0] = fabsf(xm1) < FLT_MIN ? 0.0f : xm1;
+    s->sc_state[1] = fabsf(xm2) < FLT_MIN ? 0.0f : xm2;
+    s->sc_state[2] = fabsf(ym1) < FLT_MIN ? 0.0f : ym1;
+    s->sc_state[3] = fabsf(ym2) < FLT_MIN ? 0.0f : ym2;
+    s->env = fabsf(env) < FLT_MIN ? 0.0f : env;
+  }
+}
+
+// Sets the gain of the dynamic bands of a list from their envelopes, and redesigns the section of
+// those whose gain moved straight into the active coefficients: the target of a ramp under way, or
+// the running cascade, where the change applies from the next frame.
+static void dynamic_update(t_peqbank *x, t_filter **filters, int channel) {
+  int nch = x->b_channels;
+  // A ramp under way keeps its course towards the sections redesigned here
+  int ramping = x->b_ramp_left > 0 && x->b_ramp_swap == x->b_generation;
+  int k = 0;
+  for (int i = 0; i < MAXELEM && filters[i]->type != NONE && k < x->b_max; i++) {
+    if (filters[i]->type == LPHP) {
+      k += ((t_lphp *)filters[i]->filter)->order / 2;
+      continue;
+    }
+    if (filters[i]->type != DYNAMIC) {
+      k++;
+      continue;
+    }
+    const t_dynamic *d = filters[i]->filter;
+    t_dynamic_state *s = dynamic_state(x, channel, i);
+    float over = 20.0f * log10f(fmaxf(s->env, 1e-10f)) - d->threshold;
+    float change = fminf(fmaxf(over, 0.0f) * (1.0f - 1.0f / d->ratio), fabsf(d->range));
+    if (d->range < 0.0f) change = -change;
+
+    if (fabsf(change - s->gain_dynamic) >= DYNAMIC_STEP_DB ||
+        (change == 0.0f && s->gain_dynamic != 0.0f)) {
+      float coeff[NBCOEFF];
+      s->gain_dynamic = change;
+      compute_dynamic(x, d, change, coeff);
+      for (int j = 0; j < NBCOEFF; j++) {
+        if (channel < 0) {
+          x->coeff[k * NBCOEFF + j] = coeff[j];
+        } else {
+          x->coeff[(k * NBCOEFF + j) * nch + channel] = coeff[j];
+        }
+      }
+      x->stats.section_updates++;
+      x->b_generation++;
+      if (ramping) x->b_ramp_swap = x->b_generation;
+    }
+    k++;
+  }
+}
+
+// Feeds len frames from start to the sidechains and, at the end of a control period, updates the
+// bands. The new gains apply to these frames already, which anticipates attacks by up to one
+// control period.
+static void dynamic_control(t_peqbank *x, int start, int len) {
+  int nlists = x->b_chfilters ? x->b_channels : 1;
+  for (int c = 0; c < nlists; c++) {
+    t_filter **filters = x->b_chfilters ? x->b_chfilters[c] : x->filters;
+    dynamic_detect(x, filters, x->b_chfilters ? c : -1, start, len);
+  }
+  x->b_control_left -= len;
+  if (x->b_control_left > 0) return;
+
+  x->b_control_left = x->b_control;
+  for (int c = 0; c < nlists; c++) {
+    dynamic_update(x, x->b_chfilters ? x->b_chfilters[c] : x->filters, x->b_chfilters ? c : -1);
+  }
+}
+
+int peqbank_perform(t_peqbank *x) {
+  if (x->b_nevents == 0 && x->b_dynamic == 0 && x->b_deferred == 0) return perform_block(x);
+
+  // Split the block at each event offset, at the end of each control period of the dynamic bands,
+  // and at the end of a crossfade that holds back a change
+  int n = x->s_n;
+  int start = 0, e = 0;
+  while (start < n) {
+    if (x->b_deferred && x->b_fade_left == 0) apply_deferred(x, n);
+    while (e < x->b_nevents && x->b_events[e].offset <= start) {
+      apply_event(x, &x->b_events[e++], n);
+    }
+    int end = e < x->b_nevents && x->b_events[e].offset < n ? x->b_events[e].offset : n;
+    if (x->b_deferred) end = min(end, start + x->b_fade_left);
+    if (x->b_dynamic) {
+      end = min(end, start + x->b_control_left);
+      dynamic_control(x, start, end - start);
+    }
+    perform_range(x, start, end - start, perform_block);
+    start = end;
+  }
+
+  // Carry the later events over to the next block
+  int left = 0;
+  for (; e < x->b_nevents; e++) {
+    x->b_events[left] = x->b_events[e];
+    x->b_events[left++].offset -= n;
+  }
+  x->b_nevents = left;
+  return n;
+}
+
+int peqbank_post_event(t_peqbank *x, int offset, t_filter **filters) {
+  if (x->b_nevents == MAXEVENTS) return -1;
+
+  // Keep events sorted by offset, in posting order for equal offsets
+  if (offset < 0) offset = 0;
+  int i = x->b_nevents++;
+  for (; i > 0 && x->b_events[i - 1].offset > offset; i--) x->b_events[i] = x->b_events[i - 1];
+  x->b_events[i].offset = offset;
+  x->b_events[i].filters = filters;
+  return 0;
+}
+
+void peqbank_set_ramp(t_peqbank *x, int frames) {
+  x->b_ramp = frames > 0 ? frames : 0;
+}
+
+void peqbank_set_topology(t_peqbank *x, int topology) {
+  if (topology == x->b_topology) return;
+  x->b_topology = topology;
+  x->b_fade_left = 0;  // the faded cascade's state is in the other topology's layout
+  clear_cascade(x);
+}
+
+void peqbank_set_control_rate(t_peqbank *x, int frames) {
+  x->b_control = frames > 0 ? frames : DYNAMIC_CONTROL;
+  x->b_control_left = x->b_control;
+}
+
+void peqbank_set_silence_threshold(t_peqbank *x, float threshold) {
+  x->b_silence_thresh = threshold;
+}
+
 static const int16_t limThresh = 31000;
 #define limRange (INT16_MAX - limThresh)
+#define LIMIT_UNITY 0.9999f  // Look-ahead gain treated as released (about -0.001 dB)
+
+// Soft clip: unity below the threshold t, then a rational curve that approaches full scale.
+// inv is 1 / (1 - t). Branch-free so that the conversion loops vectorize.
+static float soft_clip(float y, float t, float inv, uint64_t *limited) {
+  float a = fabsf(y);
+  float over = fmaxf(a - t, 0.0f);
+  *limited += over > 0.0f;
+  return copysignf(fminf(a, t) + over / (1.0f + over * inv), y);
+}
 
 // Ensures that the mixer never clips
 int16_t sampleLimiter(int samp) {
-  if (limThresh < samp) {
-    printf("Limiter: %6d > ", samp);
-    double s = (samp - limThresh) / (double)limRange;
-    samp = (int16_t)((atan(s) / M_PI_2) * limRange + limThresh);
-    printf("%d\n", samp);
-  } else if (samp < -limThresh) {
-    printf("Limiter: %6d > ", samp);
-    double s = -(limThresh + samp) / (double)limRange;
-    samp = (int16_t) - ((atan(s) / M_PI_2) * limRange + limThresh);
-    printf("%d\n", samp);
+  uint64_t limited = 0;
+  float y = soft_clip((float)samp, (float)limThresh, 1.0f / limRange, &limited);
+  return (int16_t)y;
+}
+
+void peqbank_set_limiter(
+    t_peqbank *x, int mode, float threshold_db, float lookahead_ms, float release_ms) {
+  x->b_limit = mode;
+  x->b_limit_thresh = min(peqbank_pow10(threshold_db * 0.05f), 0.999f);
+  x->b_limit_inv = 1.0f / (1.0f - x->b_limit_thresh);
+  x->b_limit_release = 1.0f - expf(-1000.0f / (max(release_ms, 0.01f) * x->b_Fs));
+
+  int lookahead = mode == LIMIT_LOOKAHEAD ? max((int)(lookahead_ms * 0.001f * x->b_Fs), 1) : 0;
+  if (lookahead != x->b_lookahead) {
+    free(x->b_limit_delay);
+    x->b_limit_delay = NULL;
+    if (lookahead > 0) {
+      x->b_limit_delay = (float *)malloc(lookahead * x->b_channels * sizeof(float));
+      if (x->b_limit_delay == NULL) {
+        printf("Warning: not enough memory for the limiter look-ahead. Using soft clipping.\n");
+        x->b_limit = LIMIT_SOFT;
+        lookahead = 0;
+      }
+    }
+    x->b_lookahead = lookahead;
+  }
+  peqbank_limiter_clear(x);
+}
+
+void peqbank_limiter_clear(t_peqbank *x) {
+  if (x->b_limit_delay) memset(x->b_limit_delay, 0, x->b_lookahead * x->b_channels * sizeof(float));
+  x->b_limit_pos = 0;
+  x->b_limit_hold = 0;
+  x->b_limit_gain = 1.0f;
+  x->b_limit_target = 1.0f;
+  x->b_limit_next = 1.0f;
+  x->b_limit_step = 0.0f;
+}
+
+int peqbank_limiter_latency(t_peqbank *x) {
+  return x->b_limit == LIMIT_LOOKAHEAD ? x->b_lookahead : 0;
+}
+
+// Look-ahead gain stage, run in place on the output buffers before conversion. The gain is linked
+// across channels. It ramps down over the look-ahead so that it reaches the gain a peak requires
+// by the time that peak leaves the delay line, holds while the peak is in flight, then releases.
+static uint64_t lookahead_block(t_peqbank *x) {
+  int L = x->b_lookahead;
+  int nch = x->b_channels;
+  float t = x->b_limit_thresh;
+  float gain = x->b_limit_gain;
+  float target = x->b_limit_target;
+  float next = x->b_limit_next;
+  float step = x->b_limit_step;
+  int hold = x->b_limit_hold;
+  int pos = x->b_limit_pos;
+  uint64_t limited = 0;
+
+  for (int i = 0; i < x->s_n; i++) {
+    float peak = 0.0f;
+    for (int c = 0; c < nch; c++) peak = fmaxf(peak, fabsf(x->s_vec_out[c][i]));
+    float req = peak > t ? t / peak : 1.0f;
+
+    if (req < target) {
+      target = req;
+      hold = L + 1;  // the peak leaves the delay line L frames from now, with this gain
+      step = fminf(step, (req - gain) / L);
+    } else if (req < next) {
+      next = req;  // a milder peak behind the current one
+    }
+
+    if (gain > target) {
+      gain = fmaxf(gain + step, target);
+    } else {
+      step = 0.0f;
+      if (hold == 0) {
+        target = next;
+        hold = next < 1.0f ? L : 0;
+        next = 1.0f;
+      }
+      gain += (target - gain) * x->b_limit_release;
+    }
+    if (hold > 0) hold--;
+
+    float *d = &x->b_limit_delay[pos * nch];
+    for (int c = 0; c < nch; c++) {
+      float y = d[c];
+      d[c] = x->s_vec_out[c][i];
+      x->s_vec_out[c][i] = y * gain;
+    }
+    pos = pos + 1 == L ? 0 : pos + 1;
+    limited += gain < LIMIT_UNITY ? nch : 0;
+  }
+
+  x->b_limit_gain = gain;
+  x->b_limit_target = target;
+  x->b_limit_next = next;
+  x->b_limit_step = step;
+  x->b_limit_hold = hold;
+  x->b_limit_pos = pos;
+  return limited;
+}
+
+static void stats_block(t_peqbank *x, int64_t start, uint64_t clips) {
+  int64_t elapsed = peqbank_clock_ns() - start;
+  x->stats.samples += x->s_n;
+  x->stats.blocks++;
+  x->stats.skipped_blocks += (x->b_skipped != NOSKIP);
+  x->stats.total_ns += elapsed;
+  x->stats.max_ns = max(x->stats.max_ns, elapsed);
+  x->stats.clip_events += clips;
+}
+
+void peqbank_get_stats(t_peqbank *x, t_peqbank_stats *stats, int reset) {
+  if (stats) *stats = x->stats;
+  if (reset) memset(&x->stats, 0, sizeof(x->stats));
+}
+
+void peqbank_set_metering(t_peqbank *x, int enabled) {
+  x->b_meter = enabled;
+}
+
+void peqbank_get_meters(t_peqbank *x, t_peqbank_meter *meters, int reset) {
+  for (int c = 0; meters && c < x->b_channels; c++) {
+    meters[c] = x->b_meters[c];
+    meters[c].rms = meters[c].frames ? (float)sqrt(meters[c].sum_squares / meters[c].frames) : 0.0f;
+  }
+  if (reset) memset(x->b_meters, 0, x->b_channels * sizeof(*x->b_meters));
+}
+
+// Levels of one block, kept in float while the output is stored and folded into b_meters after
+typedef struct _block_meter {
+  float peak;
+  float sum_squares;
+  int clips;
+} t_block_meter;
+
+static t_block_meter *meter_begin(t_peqbank *x, t_block_meter *m) {
+  if (!x->b_meter) return NULL;
+  memset(m, 0, x->b_channels * sizeof(*m));
+  return m;
+}
+
+static void meter_sample(t_block_meter *m, float y, int clipped) {
+  m->peak = fmaxf(m->peak, fabsf(y));
+  m->sum_squares += y * y;
+  m->clips += clipped;
+}
+
+static void meter_end(t_peqbank *x, const t_block_meter *m) {
+  if (!m) return;
+  for (int c = 0; c < x->b_channels; c++) {
+    t_peqbank_meter *total = &x->b_meters[c];
+    total->peak = fmaxf(total->peak, m[c].peak);
+    total->sum_squares += m[c].sum_squares;
+    total->clips += m[c].clips;
+    total->frames += x->s_n;
   }
-  return samp;
 }
 
 int peqbank_callback_int16(t_peqbank *x, int16_t *sig_input, int16_t *sig_output) {
+  int64_t start = peqbank_clock_ns();
+  uint64_t clips = 0;
+  uint64_t limited = 0;
+  float t = x->b_limit_thresh;
+  float inv = x->b_limit_inv;
+
   for (int i = 0; i < x->s_n; i++) {
     for (int j = 0; j < x->b_channels; j++) {
       x->s_vec_in[j][i] = (float)(sig_input[i * x->b_channels + j] / 32767.0f);
     }
   }
 
-  int k = 0;
-  if (x->b_mode == FAST) {
-    k = peqbank_perform_fast(x);
-  } else {
-    k = peqbank_perform_smooth(x);
-  }
+  int k = peqbank_perform(x);
+  if (x->b_limit == LIMIT_LOOKAHEAD) limited += lookahead_block(x);
 
+  // Saturate rather than wrap around when the limiter is off
+  t_block_meter *m = meter_begin(x, alloca(x->b_channels * sizeof(t_block_meter)));
   for (int i = 0; i < x->s_n; i++) {
     for (int j = 0; j < x->b_channels; j++) {
-      sig_output[i * x->b_channels + j] = (int)(x->s_vec_out[j][i] * 32767.0f);
+      float y = x->s_vec_out[j][i];
+      if (x->b_limit != LIMIT_OFF) y = soft_clip(y, t, inv, &limited);
+      int clipped = (y > 1.0f) | (y < -1.0f);
+      clips += clipped;
+      y = fminf(fmaxf(y, -1.0f), 1.0f);
+      if (m) meter_sample(&m[j], y, clipped);
+      sig_output[i * x->b_channels + j] = (int16_t)(y * 32767.0f);
     }
   }
+  meter_end(x, m);
+  x->stats.limit_events += limited;
+  stats_block(x, start, clips);
   return k;
 }
 
 int peqbank_callback_float(t_peqbank *x, float *sig_input, float *sig_output) {
+  int64_t start = peqbank_clock_ns();
+  uint64_t clips = 0;
+  uint64_t limited = 0;
+  float t = x->b_limit_thresh;
+  float inv = x->b_limit_inv;
+
   for (int i = 0; i < x->s_n; i++) {
     for (int j = 0; j < x->b_channels; j++) {
       x->s_vec_in[j][i] = sig_input[i * x->b_channels + j];
@@ -481,22 +1584,31 @@ int peqbank_callback_float(t_peqbank *x, float *sig_input, float *sig_output) {
     x->s_vec_out = x->s_vec_bak;  // in case we were in-place filtering previously
   }
 
-  int k = 0;
-  if (x->b_mode == FAST) {
-    k = peqbank_perform_fast(x);
-  } else {
-    k = peqbank_perform_smooth(x);
-  }
+  int k = peqbank_perform(x);
+  if (x->b_limit == LIMIT_LOOKAHEAD) limited += lookahead_block(x);
 
+  t_block_meter *m = meter_begin(x, alloca(x->b_channels * sizeof(t_block_meter)));
   for (int i = 0; i < x->s_n; i++) {
     for (int j = 0; j < x->b_channels; j++) {
-      sig_output[i * x->b_channels + j] = x->s_vec_out[j][i];
+      float y = x->s_vec_out[j][i];
+      if (x->b_limit != LIMIT_OFF) y = soft_clip(y, t, inv, &limited);
+      int clipped = (y > 1.0f) | (y < -1.0f);
+      clips += clipped;
+      if (m) meter_sample(&m[j], y, clipped);
+      sig_output[i * x->b_channels + j] = y;
     }
   }
+  meter_end(x, m);
+  x->stats.limit_events += limited;
+  stats_block(x, start, clips);
   return k;
 }
 
 void compute_shelf(t_peqbank *x, t_shelf *s, int index) {
+  compute_shelf_coeffs(x, s, &x->newcoeff[index]);
+}
+
+void compute_shelf_coeffs(t_peqbank *x, const t_shelf *s, float *coeff) {
   // Biquad coefficient estimation
   float G1 = peqbank_pow10((s->gain_low - s->gain_middle) * 0.05f);
   float G2 = peqbank_pow10((s->gain_middle - s->gain_high) * 0.05f);
@@ -517,14 +1629,14 @@ void compute_shelf(t_peqbank *x, t_shelf *s, int index) {
   float C0 = L3 * H3 * Gh;
 
   // New values
-  x->newcoeff[index] = C0;
-  x->newcoeff[index + 1] = C0 * (L2 + H2);
-  x->newcoeff[index + 2] = C0 * L2 * H2;
-  x->newcoeff[index + 3] = L1 + H1;
-  x->newcoeff[index + 4] = L1 * H1;
+  coeff[0] = C0;
+  coeff[1] = C0 * (L2 + H2);
+  coeff[2] = C0 * L2 * H2;
+  coeff[3] = L1 + H1;
+  coeff[4] = L1 * H1;
 }
 
-void compute_peq(t_peqbank *x, t_peq *p, int index) {
+void compute_peq_coeffs(t_peqbank *x, const t_peq *p, float *coeff) {
   // Biquad coefficient estimation
   float G0 = peqbank_pow10(p->gain_dc * 0.05f);
   float G = peqbank_pow10(p->gain_peak * 0.05f);
@@ -573,14 +1685,34 @@ void compute_peq(t_peqbank *x, t_peq *p, int index) {
   float val10 = 1.0f / (1.0f + W2 + A);
 
   // New values
-  x->newcoeff[index] = (G1 + G0 * W2 + B) * val10;
-  x->newcoeff[index + 1] = -2.0f * (G1 - G0 * W2) * val10;
-  x->newcoeff[index + 2] = (G1 - B + G0 * W2) * val10;
-  x->newcoeff[index + 3] = -2.0f * (1.0f - W2) * val10;
-  x->newcoeff[index + 4] = (1.0f + W2 - A) * val10;
+  coeff[0] = (G1 + G0 * W2 + B) * val10;
+  coeff[1] = -2.0f * (G1 - G0 * W2) * val10;
+  coeff[2] = (G1 - B + G0 * W2) * val10;
+  coeff[3] = -2.0f * (1.0f - W2) * val10;
+  coeff[4] = (1.0f + W2 - A) * val10;
+}
+
+void compute_peq(t_peqbank *x, t_peq *p, int index) {
+  compute_peq_coeffs(x, p, &x->newcoeff[index]);
+}
+
+// A wire while the gain of the band rounds to 0
+void compute_dynamic(t_peqbank *x, const t_dynamic *d, float gain_dynamic, float *coeff) {
+  float gain = d->gain + gain_dynamic;
+  if (fabsf(gain) < DYNAMIC_STEP_DB) {
+    coeff[0] = 1.0f;
+    coeff[1] = coeff[2] = coeff[3] = coeff[4] = 0.0f;
+    return;
+  }
+  t_peq p = {d->freq, d->bandwidth, 0.0f, gain, gain * 0.5f};
+  compute_peq_coeffs(x, &p, coeff);
 }
 
 void compute_lphp(t_peqbank *x, t_lphp *f, int index) {
+  compute_lphp_coeffs(x, f, &x->newcoeff[index]);
+}
+
+void compute_lphp_coeffs(t_peqbank *x, const t_lphp *f, float *coeff) {
   float FC, PR;
   float A0, A1, A2, B1, B2;
   float RP, IP, ES, VX, KX, T, W, M, D, X0, X1, X2, Y1, Y2;
@@ -637,14 +1769,25 @@ void compute_lphp(t_peqbank *x, t_lphp *f, int index) {
       B1 = -B1;
     }
 
-    x->newcoeff[(P * 5) + index] = A0 * GAIN;
-    x->newcoeff[(P * 5) + index + 1] = A1 * GAIN;
-    x->newcoeff[(P * 5) + index + 2] = A2 * GAIN;
-    x->newcoeff[(P * 5) + index + 3] = -B1;
-    x->newcoeff[(P * 5) + index + 4] = -B2;
+    coeff[(P * 5)] = A0 * GAIN;
+    coeff[(P * 5) + 1] = A1 * GAIN;
+    coeff[(P * 5) + 2] = A2 * GAIN;
+    coeff[(P * 5) + 3] = -B1;
+    coeff[(P * 5) + 4] = -B2;
   }
 }
 
+int peqbank_is_flat(const float *coeff, int nbiquads) {
+  for (int j = 0; j < nbiquads * NBCOEFF; j += NBCOEFF) {
+    if (fabsf(coeff[j] - 1.0f) > FLAT_TOLERANCE ||
+        fabsf(coeff[j + 1] - coeff[j + 3]) > FLAT_TOLERANCE ||
+        fabsf(coeff[j + 2] - coeff[j + 4]) > FLAT_TOLERANCE) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
 void swap_in_new_coeffs(t_peqbank *x) {
   float *prevcoeffs, *prevnew, *prevfree;
 
@@ -658,6 +1801,8 @@ void swap_in_new_coeffs(t_peqbank *x) {
 
     x->freecoeff = 0;
     x->coeff = x->newcoeff;  // Now if we're interrupted the new values will be used.
+    x->b_generation++;
+    x->stats.coeff_swaps++;
     x->newcoeff = prevfree;
 
   } else {
@@ -666,29 +1811,55 @@ void swap_in_new_coeffs(t_peqbank *x) {
 
     x->coeff = x->newcoeff;
     x->newcoeff = prevcoeffs;
+    x->b_generation++;
+    x->stats.coeff_swaps++;
   }
 }
 
-void peqbank_compute(t_peqbank *x) {
-  // Do the actual computation of coefficients, into x->newcoeff
+static int count_dynamic(t_filter **filters) {
+  int n = 0;
+  for (int i = 0; filters[i]->type != NONE; i++) n += filters[i]->type == DYNAMIC;
+  return n;
+}
+
+// Designs filters into x->newcoeff and runs the optimizer. Returns the number of biquads, and the
+// number before optimization in *ndesigned.
+static int design_filters(t_peqbank *x, t_filter **filters, int channel, int *ndesigned) {
   int i = 0;
   int c = 0;
-  while (x->filters[i]->type != NONE) {
-    switch (x->filters[i]->type) {
+  while (filters[i]->type != NONE) {
+    // Filters that no longer fit in the b_max sections are left out
+    int nsections = filters[i]->type == LPHP ? ((t_lphp *)filters[i]->filter)->order / 2 : 1;
+    if (c / NBCOEFF + nsections > x->b_max) break;
+    // A dynamic band keeps the state of the one it replaces, with its own sidechain; any other
+    // filter resets the state of its position
+    t_dynamic_state *s = dynamic_state(x, channel, i);
+    if (filters[i]->type == DYNAMIC) {
+      s->fs = 0.0f;
+    } else {
+      memset(s, 0, sizeof(*s));
+    }
+    switch (filters[i]->type) {
       case SHELF: {
-        t_shelf *s = x->filters[i]->filter;
+        t_shelf *s = filters[i]->filter;
         compute_shelf(x, s, c);
         c += NBCOEFF;
         break;
       }
       case PEQ: {
-        t_peq *p = x->filters[i]->filter;
+        t_peq *p = filters[i]->filter;
         compute_peq(x, p, c);
         c += NBCOEFF;
         break;
       }
+      case DYNAMIC: {
+        t_dynamic *d = filters[i]->filter;
+        compute_dynamic(x, d, s->gain_dynamic, &x->newcoeff[c]);
+        c += NBCOEFF;
+        break;
+      }
       case LPHP: {
-        t_lphp *f = x->filters[i]->filter;
+        t_lphp *f = filters[i]->filter;
         compute_lphp(x, f, c);
         c += (f->order / 2) * NBCOEFF;
         break;
@@ -696,8 +1867,198 @@ void peqbank_compute(t_peqbank *x) {
     }
     i++;
   }
-  x->b_nbiquads = c / NBCOEFF;
-  swap_in_new_coeffs(x);
+  *ndesigned = c / NBCOEFF;
+  if (x->b_opt_tolerance > 0.0f && count_dynamic(filters) == 0) {
+    return peqbank_optimize_coeffs(
+        x->newcoeff, *ndesigned, x->b_Fs, x->b_opt_tolerance, x->b_opt_max_error);
+  }
+  return *ndesigned;
+}
+
+// Designs each channel's list, then interleaves the designs into x->newcoeff
+static int design_channels(t_peqbank *x, int *ndesigned, int *flat, int *optimized) {
+  int nch = x->b_channels;
+  int len = x->b_max * NBCOEFF;
+  int *nb = alloca(nch * sizeof(int));
+  int nbiquads = 0;
+
+  *ndesigned = 0;
+  *flat = 1;
+  *optimized = 0;
+  for (int c = 0; c < nch; c++) {
+    int nd;
+    nb[c] = design_filters(x, x->b_chfilters[c], c, &nd);
+    memcpy(&x->b_chdesign[c * len], x->newcoeff, nb[c] * NBCOEFF * sizeof(float));
+    *flat = *flat && peqbank_is_flat(x->newcoeff, nb[c]);
+    *optimized = *optimized || nb[c] != nd;
+    nbiquads = max(nbiquads, nb[c]);
+    *ndesigned = max(*ndesigned, nd);
+  }
+  for (int k = 0; k < nbiquads; k++) {
+    for (int j = 0; j < NBCOEFF; j++) {
+      for (int c = 0; c < nch; c++) {
+        float identity = j == 0 ? 1.0f : 0.0f;
+        float v = k < nb[c] ? x->b_chdesign[c * len + k * NBCOEFF + j] : identity;
+        x->newcoeff[(k * NBCOEFF + j) * nch + c] = v;
+      }
+    }
+  }
+  return nbiquads;
+}
+
+// Section of a list whose numerator takes the headroom compensation: its first section that is
+// not a dynamic band, or the one after its dynamic bands when it only has those. Lists with
+// dynamic bands are not optimized, so their sections follow the filters.
+static int headroom_section(t_filter **filters) {
+  int k = 0;
+  for (int i = 0; filters[i]->type != NONE; i++) {
+    if (filters[i]->type != DYNAMIC) return k;
+    k++;
+  }
+  return k;
+}
+
+// Measures the peak gain of the design in x->newcoeff and, with compensation on, scales it down.
+// Returns the number of biquads, which grows by a gain section for a list of dynamic bands only.
+static int apply_headroom(t_peqbank *x, int nbiquads) {
+  int nch = x->b_channels;
+  int nlists = x->b_chfilters ? nch : 1;
+  int width = x->b_chfilters ? nch : 1;
+  float *coeff = alloca(x->b_max * NBCOEFF * sizeof(float));
+  float peak = 0.0f;
+
+  x->b_headroom = 0.0f;
+  if (!x->b_headroom_auto || nbiquads == 0) return nbiquads;
+  for (int c = 0; c < nlists; c++) {
+    for (int i = 0; i < nbiquads * NBCOEFF; i++) {
+      coeff[i] = x->b_chfilters ? x->newcoeff[i * nch + c] : x->newcoeff[i];
+    }
+    peak = fmaxf(peak, peqbank_peak_gain_coeffs(coeff, nbiquads, x->b_Fs));
+  }
+  if (peak <= 0.0f) return nbiquads;
+
+  // Every list takes the same attenuation or none, which keeps the balance between channels
+  int n = nbiquads;
+  for (int c = 0; c < nlists; c++) {
+    int k = headroom_section(x->b_chfilters ? x->b_chfilters[c] : x->filters);
+    if (k >= x->b_max) return nbiquads;
+    n = max(n, k + 1);
+  }
+  for (int i = nbiquads * NBCOEFF * width; i < n * NBCOEFF * width; i++) {
+    x->newcoeff[i] = i / width % NBCOEFF == 0 ? 1.0f : 0.0f;
+  }
+
+  float gain = peqbank_pow10(-peak / 20.0f);
+  for (int c = 0; c < nlists; c++) {
+    int k = headroom_section(x->b_chfilters ? x->b_chfilters[c] : x->filters);
+    for (int j = 0; j < 3; j++) x->newcoeff[(k * NBCOEFF + j) * width + c] *= gain;
+  }
+  x->b_headroom = peak;
+  return n;
+}
+
+// Designs the current filters at x->b_Fs into x->newcoeff, leaving the active cascade alone
+static int design(t_peqbank *x, int *ndesigned, int *flat, int *optimized) {
+  int nbiquads;
+  if (x->b_chfilters) {
+    x->b_dynamic = 0;
+    for (int c = 0; c < x->b_channels; c++) x->b_dynamic += count_dynamic(x->b_chfilters[c]);
+    nbiquads = design_channels(x, ndesigned, flat, optimized);
+    nbiquads = apply_headroom(x, nbiquads);
+  } else {
+    x->b_dynamic = count_dynamic(x->filters);
+    nbiquads = design_filters(x, x->filters, -1, ndesigned);
+    *optimized = nbiquads != *ndesigned;
+    nbiquads = apply_headroom(x, nbiquads);
+    *flat = peqbank_is_flat(x->newcoeff, nbiquads);
+  }
+  // Dynamic bands are redesigned in place by the callbacks: the optimizer leaves their lists
+  // alone so that each band keeps its section, and the bank never skips them as flat
+  if (x->b_dynamic) *flat = 0;
+  return nbiquads;
+}
+
+void peqbank_compute(t_peqbank *x) {
+  int nbiquads = x->b_nbiquads;
+  int optimized = x->b_optimized;
+  // Do the actual computation of coefficients, into x->newcoeff
+  x->b_nrates = 0;  // precomputed for the previous filters
+  if (defer(x, NULL)) return;
+  x->b_nbiquads = design(x, &x->b_ndesigned, &x->b_flat, &x->b_optimized);
+  activate(x, nbiquads, x->b_chfilters != NULL, optimized || x->b_optimized, x->s_n);
+}
+
+int peqbank_precompute_rates(t_peqbank *x, const int *rates, int num_rates) {
+  int ncoeff = x->b_max * NBCOEFF * x->b_channels;
+  peqbank_free_rate_sets(x);
+  if (num_rates <= 0 || x->filters == NULL) return 0;
+
+  t_peqbank_rate *sets = (t_peqbank_rate *)malloc(num_rates * sizeof(t_peqbank_rate));
+  float *coeff = (float *)malloc(num_rates * ncoeff * sizeof(float));
+  if (sets == NULL || coeff == NULL) {
+    free(sets);
+    free(coeff);
+    return -1;
+  }
+
+  float fs = x->b_Fs;
+  float headroom = x->b_headroom;
+  for (int i = 0; i < num_rates; i++) {
+    t_peqbank_rate *r = &sets[i];
+    x->b_Fs = (float)rates[i];
+    r->rate = rates[i];
+    r->nbiquads = design(x, &r->ndesigned, &r->flat, &r->optimized);
+    r->headroom = x->b_headroom;
+    r->coeff = &coeff[i * ncoeff];
+    memcpy(r->coeff, x->newcoeff, ncoeff * sizeof(float));
+  }
+  x->b_Fs = fs;
+  x->b_headroom = headroom;
+  x->b_rate_sets = sets;
+  x->b_nrates = num_rates;
+  return 0;
+}
+
+int peqbank_set_sample_rate(t_peqbank *x, int sampling_rate) {
+  if (sampling_rate <= 0) return -1;
+  float fs = x->b_Fs;
+  int nbiquads = x->b_nbiquads;
+  int optimized = x->b_optimized;
+  int per_channel = x->b_chfilters != NULL;
+  x->b_Fs = (float)sampling_rate;
+
+  // 1 - release is the per-sample decay of the release, exp(-1000 / (release_ms * Fs))
+  x->b_limit_release = 1.0f - powf(1.0f - x->b_limit_release, fs / x->b_Fs);
+  if (defer(x, NULL)) return 0;
+
+  for (int i = 0; i < x->b_nrates; i++) {
+    t_peqbank_rate *r = &x->b_rate_sets[i];
+    if (r->rate == sampling_rate) {
+      memcpy(x->newcoeff, r->coeff, x->b_max * NBCOEFF * x->b_channels * sizeof(float));
+      x->b_nbiquads = r->nbiquads;
+      x->b_ndesigned = r->ndesigned;
+      x->b_flat = r->flat;
+      x->b_optimized = r->optimized;
+      x->b_headroom = r->headroom;
+      activate(x, nbiquads, per_channel, optimized || x->b_optimized, x->s_n);
+      return 0;
+    }
+  }
+  if (x->filters) {
+    x->b_nbiquads = design(x, &x->b_ndesigned, &x->b_flat, &x->b_optimized);
+    activate(x, nbiquads, per_channel, optimized || x->b_optimized, x->s_n);
+  }
+  return 0;
+}
+
+int peqbank_channel_coeffs(t_peqbank *x, int channel, float *coeff) {
+  int nch = x->b_channels;
+  if (!x->b_chfilters) {
+    memcpy(coeff, x->coeff, x->b_nbiquads * NBCOEFF * sizeof(float));
+    return x->b_nbiquads;
+  }
+  for (int i = 0; i < x->b_nbiquads * NBCOEFF; i++) coeff[i] = x->coeff[i * nch + channel];
+  return x->b_nbiquads;
 }
 
 void peqbank_reset(t_peqbank *x) {
@@ -710,16 +2071,16 @@ void peqbank_reset(t_peqbank *x) {
   }
 
   if (x->coeff) {
-    memset(x->coeff, 0, x->b_max * NBCOEFF * sizeof(float));
+    memset(x->coeff, 0, x->b_max * NBCOEFF * x->b_channels * sizeof(float));
   }
   if (x->oldcoeff) {
-    memset(x->oldcoeff, 0, x->b_max * NBCOEFF * sizeof(float));
+    memset(x->oldcoeff, 0, x->b_max * NBCOEFF * x->b_channels * sizeof(float));
   }
   if (x->newcoeff) {
-    memset(x->newcoeff, 0, x->b_max * NBCOEFF * sizeof(float));
+    memset(x->newcoeff, 0, x->b_max * NBCOEFF * x->b_channels * sizeof(float));
   }
   if (x->freecoeff) {
-    memset(x->freecoeff, 0, x->b_max * NBCOEFF * sizeof(float));
+    memset(x->freecoeff, 0, x->b_max * NBCOEFF * x->b_channels * sizeof(float));
   }
   if (x->b_ym1) {
     memset(x->b_ym1, 0, x->b_max * x->b_channels * sizeof(float));
@@ -809,6 +2170,30 @@ t_filter *new_highpass(float freq, float ripple, int order) {
   return lphp;
 }
 
+t_filter *new_dynamic(float freq,
+                      float bandwidth,
+                      float gain,
+                      float threshold,
+                      float ratio,
+                      float range,
+                      float attack_ms,
+                      float release_ms) {
+  t_dynamic *dynamic = (t_dynamic *)malloc(sizeof(t_dynamic));
+  dynamic->freq = freq;
+  dynamic->bandwidth = bandwidth;
+  dynamic->gain = gain;
+  dynamic->threshold = threshold;
+  dynamic->ratio = fmaxf(ratio, 1.0f);
+  dynamic->range = range;
+  dynamic->attack = attack_ms;
+  dynamic->release = release_ms;
+
+  t_filter *filter = (t_filter *)malloc(sizeof(t_filter));
+  filter->type = DYNAMIC;
+  filter->filter = dynamic;
+  return filter;
+}
+
 t_filter **new_filters(int num_filters) {
   int actual_num_filters = min(num_filters, MAXELEM);
   t_filter **filters = (t_filter **)malloc((actual_num_filters + 1) * sizeof(t_filter *));
@@ -830,8 +2215,88 @@ void free_filters(t_filter **filters) {
   free(filters[i]);
 }
 
+static const char *const spec_names[] = {"lowpass", "highpass", "shelf", "peq", "dynamic"};
+static const int spec_params[] = {3, 3, 5, 5, 8};
+
+static t_filter *new_filter_from_spec(int kind, const float *v) {
+  t_filter *f = NULL;
+  if (kind == 0 || kind == 1) {
+    f = new_lphp(v[0], v[1], (int)v[2]);
+    if (f) ((t_lphp *)f->filter)->type = kind == 0 ? LOWPASS : HIGHPASS;
+  } else if (kind == 2) {
+    f = new_shelf(v[0], v[1], v[2], v[3], v[4]);
+  } else if (kind == 3) {
+    f = new_peq(v[0], v[1], v[2], v[3], v[4]);
+  } else {
+    f = new_dynamic(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+  }
+  return f;
+}
+
+t_filter **new_filters_from_spec(const char *spec) {
+  int count = *spec ? 1 : 0;
+  for (const char *p = spec; *p; p++) count += *p == ';';
+  if (count > MAXELEM) return NULL;
+
+  t_filter **filters = new_filters(count);
+  int n = 0;
+  int nsections = 0;  // Biquads of the filters parsed so far, at most MAXELEM
+  const char *p = spec;
+  while (n < count) {
+    while (*p == ' ') p++;
+    const char *colon = strchr(p, ':');
+    if (colon == NULL) break;
+
+    int kind = -1;
+    for (int k = 0; k < 5; k++) {
+      if ((int)strlen(spec_names[k]) == colon - p && strncmp(p, spec_names[k], colon - p) == 0) {
+        kind = k;
+      }
+    }
+    if (kind < 0) break;
+
+    float v[8];
+    char *end = (char *)colon;
+    int i = 0;
+    for (; i < spec_params[kind]; i++) {
+      const char *start = end + 1;
+      v[i] = strtof(start, &end);
+      if (end == start || (i + 1 < spec_params[kind] && *end != ',')) break;
+    }
+    while (*end == ' ') end++;
+    if (i < spec_params[kind] || (*end != ';' && *end != '\0')) break;
+
+    t_filter *f = new_filter_from_spec(kind, v);
+    if (f == NULL) break;
+    nsections += f->type == LPHP ? ((t_lphp *)f->filter)->order / 2 : 1;
+    if (nsections > MAXELEM) {
+      free(f->filter);
+      free(f);
+      break;
+    }
+    filters[n++] = f;
+    p = *end ? end + 1 : end;
+  }
+
+  if (n < count) {
+    filters[n] = filters[count];  // move the terminator so that free_filters stops here
+    free_filters(filters);
+    free(filters);
+    return NULL;
+  }
+  return filters;
+}
+
 void peqbank_setup(t_peqbank *x, t_filter **filters) {
   peqbank_init(x);
   x->filters = filters;
+  x->b_chfilters = NULL;
+  peqbank_compute(x);
+}
+
+void peqbank_setup_channels(t_peqbank *x, t_filter ***filters) {
+  peqbank_init(x);
+  x->filters = filters[0];
+  x->b_chfilters = filters;
   peqbank_compute(x);
 }
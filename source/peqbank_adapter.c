@@ -0,0 +1,133 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank_adapter.h"
+
+t_peqbank_adapter *peqbank_adapter_new(t_peqbank *x, int mode) {
+  t_peqbank_adapter *a = (t_peqbank_adapter *)malloc(sizeof(t_peqbank_adapter));
+  if (!a) {
+    return NULL;
+  }
+
+  a->x = x;
+  a->b_mode = mode;
+  a->b_block = x->s_n;
+  a->b_channels = x->b_channels;
+  a->b_latency = mode == ADAPT_BUFFERED ? a->b_block - 1 : 0;
+  a->s_in = (float *)malloc(a->b_block * a->b_channels * sizeof(float));
+  a->s_ring = (float *)malloc(2 * a->b_block * a->b_channels * sizeof(float));
+  if (a->s_in == NULL || a->s_ring == NULL) {
+    peqbank_adapter_free(a);
+    return NULL;
+  }
+  peqbank_adapter_clear(a);
+  return a;
+}
+
+void peqbank_adapter_free(t_peqbank_adapter *a) {
+  free(a->s_in);
+  free(a->s_ring);
+  free(a);
+}
+
+// The ring starts with b_latency frames of silence ready to be read
+void peqbank_adapter_clear(t_peqbank_adapter *a) {
+  memset(a->s_ring, 0, 2 * a->b_block * a->b_channels * sizeof(float));
+  a->s_fill = 0;
+  a->s_write = 0;
+  a->s_read = (a->b_block + 1) % (2 * a->b_block);
+}
+
+int peqbank_adapter_latency(t_peqbank_adapter *a) {
+  return a->b_latency;
+}
+
+// Copies the input into the block being filled, processes it once full, and plays the same number
+// of frames from the ring. Full blocks are written to the ring at s_write, so they never wrap.
+static void buffered_chunk(t_peqbank_adapter *a, const void *in, void *out, int n, int int16) {
+  int ch = a->b_channels;
+  float *dst = &a->s_in[a->s_fill * ch];
+  if (int16) {
+    for (int i = 0; i < n * ch; i++) dst[i] = ((const int16_t *)in)[i] / 32767.0f;
+  } else {
+    memcpy(dst, in, n * ch * sizeof(float));
+  }
+  a->s_fill += n;
+  if (a->s_fill == a->b_block) {
+    peqbank_callback_float(a->x, a->s_in, &a->s_ring[a->s_write * ch]);
+    a->s_write = (a->s_write + a->b_block) % (2 * a->b_block);
+    a->s_fill = 0;
+  }
+
+  int ring = 2 * a->b_block;
+  for (int done = 0; done < n;) {
+    int m = min(n - done, ring - a->s_read);
+    const float *src = &a->s_ring[a->s_read * ch];
+    if (int16) {
+      int16_t *o = (int16_t *)out + done * ch;
+      for (int i = 0; i < m * ch; i++) {
+        o[i] = (int16_t)(fminf(fmaxf(src[i], -1.0f), 1.0f) * 32767.0f);
+      }
+    } else {
+      memcpy((float *)out + done * ch, src, m * ch * sizeof(float));
+    }
+    a->s_read = (a->s_read + m) % ring;
+    done += m;
+  }
+}
+
+static int adapter_process(t_peqbank_adapter *a, const void *in, void *out, int frames, int int16) {
+  int ch = a->b_channels;
+  size_t size = int16 ? sizeof(int16_t) : sizeof(float);
+  for (int done = 0; done < frames;) {
+    const char *src = (const char *)in + done * ch * size;
+    char *dst = (char *)out + done * ch * size;
+    int n;
+    if (a->b_mode == ADAPT_BUFFERED) {
+      n = min(frames - done, a->b_block - a->s_fill);
+      buffered_chunk(a, src, dst, n, int16);
+    } else {
+      // Full blocks, then the remainder as one shorter block
+      n = min(frames - done, a->b_block);
+      a->x->s_n = n;
+      if (int16) {
+        peqbank_callback_int16(a->x, (int16_t *)src, (int16_t *)dst);
+      } else {
+        peqbank_callback_float(a->x, (float *)src, (float *)dst);
+      }
+      a->x->s_n = a->b_block;
+    }
+    done += n;
+  }
+  return frames;
+}
+
+int peqbank_adapter_float(t_peqbank_adapter *a,
+                          const float *sig_input,
+                          float *sig_output,
+                          int num_frames) {
+  return adapter_process(a, sig_input, sig_output, num_frames, 0);
+}
+
+int peqbank_adapter_int16(t_peqbank_adapter *a,
+                          const int16_t *sig_input,
+                          int16_t *sig_output,
+                          int num_frames) {
+  return adapter_process(a, sig_input, sig_output, num_frames, 1);
+}
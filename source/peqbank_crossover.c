@@ -0,0 +1,145 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank_crossover.h"
+
+t_peqbank_crossover *peqbank_crossover_new(t_peqbank *x,
+                                           const float *freqs,
+                                           int num_bands,
+                                           int order) {
+  if (num_bands < 2 || num_bands > CROSSOVER_MAX_BANDS || order < 4 ||
+      order > CROSSOVER_MAX_ORDER || order % 4 != 0) {
+    return NULL;
+  }
+  for (int k = 0; k < num_bands - 1; k++) {
+    if (freqs[k] <= (k > 0 ? freqs[k - 1] : 0.0f) || freqs[k] >= x->b_Fs * 0.5f) return NULL;
+  }
+
+  t_peqbank_crossover *c = (t_peqbank_crossover *)malloc(sizeof(t_peqbank_crossover));
+  if (!c) {
+    return NULL;
+  }
+
+  int nsplits = num_bands - 1;
+  int nsections = order / 4;
+  c->b_channels = x->b_channels;
+  c->b_bands = num_bands;
+  c->b_sections = nsections;
+  // Lowpass and highpass of every split, and the allpasses of the splits above each lower band
+  c->b_nstate = nsections * (4 * nsplits + nsplits * (nsplits - 1) / 2);
+  c->b_lowpass = (float *)malloc(nsplits * nsections * NBCOEFF * sizeof(float));
+  c->b_highpass = (float *)malloc(nsplits * nsections * NBCOEFF * sizeof(float));
+  c->b_allpass = (float *)malloc(nsplits * nsections * NBCOEFF * sizeof(float));
+  c->b_state = (float *)malloc(c->b_nstate * c->b_channels * 4 * sizeof(float));
+  if (!c->b_lowpass || !c->b_highpass || !c->b_allpass || !c->b_state) {
+    peqbank_crossover_free(c);
+    return NULL;
+  }
+
+  for (int k = 0; k < nsplits; k++) {
+    t_lphp lowpass = {freqs[k], 0.0f, order / 2, LOWPASS};
+    t_lphp highpass = {freqs[k], 0.0f, order / 2, HIGHPASS};
+    compute_lphp_coeffs(x, &lowpass, &c->b_lowpass[k * nsections * NBCOEFF]);
+    compute_lphp_coeffs(x, &highpass, &c->b_highpass[k * nsections * NBCOEFF]);
+    // The sum of the two Linkwitz-Riley filters: numerator is the reversed denominator
+    for (int j = 0; j < nsections; j++) {
+      const float *lp = &c->b_lowpass[(k * nsections + j) * NBCOEFF];
+      float *ap = &c->b_allpass[(k * nsections + j) * NBCOEFF];
+      ap[0] = lp[4];
+      ap[1] = lp[3];
+      ap[2] = 1.0f;
+      ap[3] = lp[3];
+      ap[4] = lp[4];
+    }
+  }
+  peqbank_crossover_clear(c);
+  return c;
+}
+
+void peqbank_crossover_free(t_peqbank_crossover *c) {
+  free(c->b_lowpass);
+  free(c->b_highpass);
+  free(c->b_allpass);
+  free(c->b_state);
+  free(c);
+}
+
+void peqbank_crossover_clear(t_peqbank_crossover *c) {
+  memset(c->b_state, 0, c->b_nstate * c->b_channels * 4 * sizeof(float));
+}
+
+// Runs one section in place over n samples
+static void run_section(const float *coeff, float *state, float *buf, int n) {
+  float a0 = coeff[0], a1 = coeff[1], a2 = coeff[2], b1 = coeff[3], b2 = coeff[4];
+  float xm1 = state[0], xm2 = state[1], ym1 = state[2], ym2 = state[3];
+
+  for (int i = 0; i < n; i++) {
+    float xn = buf[i];
+    float yn = a0 * xn + a1 * xm1 + a2 * xm2 - b1 * ym1 - b2 * ym2;
+    xm2 = xm1;
+    xm1 = xn;
+    ym2 = ym1;
+    ym1 = yn;
+    buf[i] = yn;
+  }
+
+  state[0] = xm1;
+  state[1] = xm2;
+  state[2] = ym1;
+  state[3] = ym2;
+  state[2] = FLUSH_TO_ZERO(state[2]);
+  state[3] = FLUSH_TO_ZERO(state[3]);
+}
+
+// Runs the Linkwitz-Riley filter of a split: its Butterworth sections twice
+static float *run_twice(
+    const t_peqbank_crossover *c, const float *coeff, float *state, float *buf, int n) {
+  for (int j = 0; j < 2 * c->b_sections; j++, state += 4) {
+    run_section(&coeff[(j % c->b_sections) * NBCOEFF], state, buf, n);
+  }
+  return state;
+}
+
+void peqbank_crossover_float(t_peqbank_crossover *c,
+                             const float *sig_input,
+                             float **band_outputs,
+                             int num_frames) {
+  int nch = c->b_channels;
+  int nsplits = c->b_bands - 1;
+  int nsections = c->b_sections;
+
+  for (int ch = 0; ch < nch; ch++) {
+    float *state = &c->b_state[ch * c->b_nstate * 4];
+    // The top band holds what is left above the splits done so far
+    float *rest = band_outputs[nsplits * nch + ch];
+    for (int i = 0; i < num_frames; i++) rest[i] = sig_input[i * nch + ch];
+
+    for (int k = 0; k < nsplits; k++) {
+      float *band = band_outputs[k * nch + ch];
+      memcpy(band, rest, num_frames * sizeof(float));
+      state = run_twice(c, &c->b_lowpass[k * nsections * NBCOEFF], state, band, num_frames);
+      state = run_twice(c, &c->b_highpass[k * nsections * NBCOEFF], state, rest, num_frames);
+      for (int m = k + 1; m < nsplits; m++) {
+        for (int j = 0; j < nsections; j++, state += 4) {
+          run_section(&c->b_allpass[(m * nsections + j) * NBCOEFF], state, band, num_frames);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,336 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank_fir.h"
+
+#define FIR_MIN_GRID 1024  // Minimum size of the frequency grid used to sample the magnitude
+
+static int next_pow2(int n) {
+  int p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+int peqbank_fft_init(t_peqbank_fft *plan, int n) {
+  int bits = 0;
+  while ((1 << bits) < n) bits++;
+
+  plan->n = n;
+  plan->bitrev = (int *)malloc(n * sizeof(int));
+  plan->twcos = (float *)malloc((n / 2 + 1) * sizeof(float));
+  plan->twsin = (float *)malloc((n / 2 + 1) * sizeof(float));
+  if (plan->bitrev == NULL || plan->twcos == NULL || plan->twsin == NULL) {
+    peqbank_fft_free(plan);
+    return 0;
+  }
+
+  for (int i = 0; i < n; i++) {
+    int r = 0;
+    for (int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+    plan->bitrev[i] = r;
+  }
+  for (int k = 0; k <= n / 2; k++) {
+    plan->twcos[k] = (float)cos(2.0 * M_PI * k / n);
+    plan->twsin[k] = (float)sin(2.0 * M_PI * k / n);
+  }
+  return 1;
+}
+
+void peqbank_fft_free(t_peqbank_fft *plan) {
+  free(plan->bitrev);
+  free(plan->twcos);
+  free(plan->twsin);
+  plan->bitrev = NULL;
+  plan->twcos = NULL;
+  plan->twsin = NULL;
+}
+
+// In-place radix-2 FFT on n interleaved complex values. The inverse is not scaled.
+void peqbank_fft(const t_peqbank_fft *plan, float *data, int inverse) {
+  int n = plan->n;
+  float sign = inverse ? 1.0f : -1.0f;
+
+  for (int i = 0; i < n; i++) {
+    int r = plan->bitrev[i];
+    if (r > i) {
+      float tr = data[2 * i];
+      float ti = data[2 * i + 1];
+      data[2 * i] = data[2 * r];
+      data[2 * i + 1] = data[2 * r + 1];
+      data[2 * r] = tr;
+      data[2 * r + 1] = ti;
+    }
+  }
+
+  for (int len = 2; len <= n; len <<= 1) {
+    int half = len >> 1;
+    int step = n / len;
+    for (int i = 0; i < n; i += len) {
+      for (int j = 0; j < half; j++) {
+        float wr = plan->twcos[j * step];
+        float wi = sign * plan->twsin[j * step];
+        float *u = &data[2 * (i + j)];
+        float *v = &data[2 * (i + j + half)];
+        float vr = v[0] * wr - v[1] * wi;
+        float vi = v[0] * wi + v[1] * wr;
+        v[0] = u[0] - vr;
+        v[1] = u[1] - vi;
+        u[0] += vr;
+        u[1] += vi;
+      }
+    }
+  }
+}
+
+t_peqbank_fir *peqbank_fir_new(t_peqbank *x, int num_taps, int block_size) {
+  if (x->b_chfilters) return NULL;  // channels in a pair share one kernel
+  t_peqbank_fir *f = (t_peqbank_fir *)calloc(1, sizeof(t_peqbank_fir));
+
+  if (!f) {
+    return NULL;
+  }
+
+  f->b_Fs = x->b_Fs;
+  f->b_channels = x->b_channels;
+  f->b_taps = num_taps | 1;  // symmetric FIR of odd length has an integer group delay
+  f->b_block = next_pow2(max(block_size, 4));
+  f->b_parts = (f->b_taps + f->b_block - 1) / f->b_block;
+  f->b_latency = f->b_taps / 2 + f->b_block;
+  f->s_n = x->s_n;
+
+  int pairs = (f->b_channels + 1) / 2;
+  int spec = 4 * f->b_block;  // 2 * b_block complex values
+  f->h_spec = (float *)calloc(f->b_parts * spec, sizeof(float));
+  f->fdl = (float *)calloc(pairs * f->b_parts * spec, sizeof(float));
+  f->work = (float *)calloc(spec, sizeof(float));
+  f->s_prev = (float **)calloc(f->b_channels, sizeof(float *));
+  f->s_cur = (float **)calloc(f->b_channels, sizeof(float *));
+  f->s_out = (float **)calloc(f->b_channels, sizeof(float *));
+  if (!peqbank_fft_init(&f->fft, 2 * f->b_block) || f->h_spec == NULL || f->fdl == NULL ||
+      f->work == NULL || f->s_prev == NULL || f->s_cur == NULL || f->s_out == NULL) {
+    peqbank_fir_free(f);
+    return NULL;
+  }
+  for (int c = 0; c < f->b_channels; c++) {
+    f->s_prev[c] = (float *)calloc(f->b_block, sizeof(float));
+    f->s_cur[c] = (float *)calloc(f->b_block, sizeof(float));
+    f->s_out[c] = (float *)calloc(f->b_block, sizeof(float));
+    if (f->s_prev[c] == NULL || f->s_cur[c] == NULL || f->s_out[c] == NULL) {
+      peqbank_fir_free(f);
+      return NULL;
+    }
+  }
+
+  if (peqbank_fir_design(f, x) < 0) {
+    peqbank_fir_free(f);
+    return NULL;
+  }
+  return f;
+}
+
+int peqbank_fir_design(t_peqbank_fir *f, t_peqbank *x) {
+  if (x->b_chfilters) return -1;
+  int taps = f->b_taps;
+  int half = taps / 2;
+  int grid = next_pow2(max(4 * taps, FIR_MIN_GRID));
+
+  t_peqbank_fft plan;
+  float *freqs = (float *)malloc((grid / 2 + 1) * sizeof(float));
+  float *mag = (float *)malloc((grid / 2 + 1) * sizeof(float));
+  float *spec = (float *)malloc(2 * grid * sizeof(float));
+  if (freqs == NULL || mag == NULL || spec == NULL || !peqbank_fft_init(&plan, grid)) {
+    printf("Warning: not enough memory to design the linear-phase filter.\n");
+    free(freqs);
+    free(mag);
+    free(spec);
+    return -1;
+  }
+
+  // Zero-phase spectrum sampled from the magnitude of the designed cascade
+  for (int k = 0; k <= grid / 2; k++) freqs[k] = k * x->b_Fs / grid;
+  peqbank_response(x, freqs, grid / 2 + 1, mag, NULL, NULL);
+  for (int k = 0; k <= grid / 2; k++) {
+    float a = peqbank_pow10(mag[k] * 0.05f);
+    spec[2 * k] = a;
+    spec[2 * k + 1] = 0.0f;
+    if (k > 0 && k < grid / 2) {
+      spec[2 * (grid - k)] = a;
+      spec[2 * (grid - k) + 1] = 0.0f;
+    }
+  }
+  peqbank_fft(&plan, spec, 1);
+
+  // Centre, window (Blackman) and split the impulse response into partitions. The 1/grid scale of
+  // the design transform and the 1/(2 * b_block) scale of the running inverse FFT are folded in.
+  float scale = 1.0f / ((float)grid * 2.0f * f->b_block);
+  int spec_len = 4 * f->b_block;
+  memset(f->h_spec, 0, f->b_parts * spec_len * sizeof(float));
+  for (int n = 0; n < taps; n++) {
+    int k = (n - half + grid) % grid;
+    float w = 1.0f;
+    if (taps > 1) {
+      float t = TWOPI * n / (taps - 1);
+      w = 0.42f - 0.5f * cosf(t) + 0.08f * cosf(2.0f * t);
+    }
+    int p = n / f->b_block;
+    int i = n % f->b_block;
+    f->h_spec[p * spec_len + 2 * i] = spec[2 * k] * w * scale;
+  }
+  for (int p = 0; p < f->b_parts; p++) peqbank_fft(&f->fft, &f->h_spec[p * spec_len], 0);
+
+  peqbank_fft_free(&plan);
+  free(freqs);
+  free(mag);
+  free(spec);
+  return 0;
+}
+
+void peqbank_fir_clear(t_peqbank_fir *f) {
+  int pairs = (f->b_channels + 1) / 2;
+  memset(f->fdl, 0, pairs * f->b_parts * 4 * f->b_block * sizeof(float));
+  for (int c = 0; c < f->b_channels; c++) {
+    memset(f->s_prev[c], 0, f->b_block * sizeof(float));
+    memset(f->s_cur[c], 0, f->b_block * sizeof(float));
+    memset(f->s_out[c], 0, f->b_block * sizeof(float));
+  }
+  f->fdl_pos = 0;
+  f->s_pos = 0;
+}
+
+void peqbank_fir_free(t_peqbank_fir *f) {
+  if (!f) return;
+  for (int c = 0; c < f->b_channels; c++) {
+    if (f->s_prev) free(f->s_prev[c]);
+    if (f->s_cur) free(f->s_cur[c]);
+    if (f->s_out) free(f->s_out[c]);
+  }
+  free(f->s_prev);
+  free(f->s_cur);
+  free(f->s_out);
+  free(f->h_spec);
+  free(f->fdl);
+  free(f->work);
+  peqbank_fft_free(&f->fft);
+  free(f);
+}
+
+int peqbank_fir_latency(t_peqbank_fir *f) {
+  return f->b_latency;
+}
+
+// One hop of overlap-save: transform [previous, current] partition, multiply-accumulate against
+// the partition spectra through the delay line and keep the last b_block samples.
+static void fir_process_partition(t_peqbank_fir *f) {
+  int B = f->b_block;
+  int spec_len = 4 * B;
+  int nfft = 2 * B;
+  float *work = f->work;
+
+  for (int c0 = 0; c0 < f->b_channels; c0 += 2) {
+    int c1 = c0 + 1;
+    float *fdl = &f->fdl[(c0 / 2) * f->b_parts * spec_len];
+    float *slot = &fdl[f->fdl_pos * spec_len];
+
+    for (int i = 0; i < B; i++) {
+      slot[2 * i] = f->s_prev[c0][i];
+      slot[2 * (B + i)] = f->s_cur[c0][i];
+    }
+    if (c1 < f->b_channels) {
+      for (int i = 0; i < B; i++) {
+        slot[2 * i + 1] = f->s_prev[c1][i];
+        slot[2 * (B + i) + 1] = f->s_cur[c1][i];
+      }
+    } else {
+      for (int i = 0; i < nfft; i++) slot[2 * i + 1] = 0.0f;
+    }
+    peqbank_fft(&f->fft, slot, 0);
+
+    memset(work, 0, spec_len * sizeof(float));
+    for (int p = 0; p < f->b_parts; p++) {
+      const float *xs = &fdl[((f->fdl_pos - p + f->b_parts) % f->b_parts) * spec_len];
+      const float *hs = &f->h_spec[p * spec_len];
+      for (int k = 0; k < nfft; k++) {
+        float xr = xs[2 * k], xi = xs[2 * k + 1];
+        float hr = hs[2 * k], hi = hs[2 * k + 1];
+        work[2 * k] += xr * hr - xi * hi;
+        work[2 * k + 1] += xr * hi + xi * hr;
+      }
+    }
+    peqbank_fft(&f->fft, work, 1);
+
+    for (int i = 0; i < B; i++) f->s_out[c0][i] = work[2 * (B + i)];
+    if (c1 < f->b_channels) {
+      for (int i = 0; i < B; i++) f->s_out[c1][i] = work[2 * (B + i) + 1];
+    }
+  }
+
+  // The partition just filled becomes the overlap of the next hop
+  for (int c = 0; c < f->b_channels; c++) {
+    float *tmp = f->s_prev[c];
+    f->s_prev[c] = f->s_cur[c];
+    f->s_cur[c] = tmp;
+  }
+  f->fdl_pos = (f->fdl_pos + 1) % f->b_parts;
+}
+
+int peqbank_fir_callback_int16(t_peqbank_fir *f, int16_t *sig_input, int16_t *sig_output) {
+  int nch = f->b_channels;
+  int i = 0;
+  while (i < f->s_n) {
+    int run = min(f->s_n - i, f->b_block - f->s_pos);
+    for (int r = 0; r < run; r++) {
+      for (int c = 0; c < nch; c++) {
+        float y = f->s_out[c][f->s_pos + r] * 32767.0f;
+        y = y > 32767.0f ? 32767.0f : (y < -32768.0f ? -32768.0f : y);
+        f->s_cur[c][f->s_pos + r] = (float)(sig_input[(i + r) * nch + c] / 32767.0f);
+        sig_output[(i + r) * nch + c] = (int16_t)y;
+      }
+    }
+    i += run;
+    f->s_pos += run;
+    if (f->s_pos == f->b_block) {
+      fir_process_partition(f);
+      f->s_pos = 0;
+    }
+  }
+  return f->s_n;
+}
+
+int peqbank_fir_callback_float(t_peqbank_fir *f, float *sig_input, float *sig_output) {
+  int nch = f->b_channels;
+  int i = 0;
+  while (i < f->s_n) {
+    int run = min(f->s_n - i, f->b_block - f->s_pos);
+    for (int r = 0; r < run; r++) {
+      for (int c = 0; c < nch; c++) {
+        // read before write so that in-place processing works
+        float y = f->s_out[c][f->s_pos + r];
+        f->s_cur[c][f->s_pos + r] = sig_input[(i + r) * nch + c];
+        sig_output[(i + r) * nch + c] = y;
+      }
+    }
+    i += run;
+    f->s_pos += run;
+    if (f->s_pos == f->b_block) {
+      fir_process_partition(f);
+      f->s_pos = 0;
+    }
+  }
+  return f->s_n;
+}
@@ -0,0 +1,378 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank.h"
+
+#define FIT_FREQ_MIN 20.0f       // Default limits
+#define FIT_GAIN_MAX 18.0f
+#define FIT_BANDWIDTH_MIN 0.05f
+#define FIT_BANDWIDTH_MAX 4.0f
+#define FIT_MIN_GAIN 1e-3f       // PEQ bands with less gain are a wire: the design needs a gain
+#define FIT_STEP 1e-3            // Finite-difference step of every parameter
+#define FIT_BAND_ITERATIONS 20   // Gauss-Newton steps fitting a new band alone
+#define FIT_ITERATIONS 50        // Gauss-Newton steps refining all bands together
+#define FIT_TOLERANCE 1e-5       // Relative decrease of the error below which the steps stop
+#define FIT_DAMPING_MAX 1e8      // Damping above which no step decreases the error any more
+#define FIT_EPSILON 1e-30
+
+// Parameters of a shelf band: log2(freq_low), log2(freq_high), gain_low, gain_middle, gain_high.
+// Of a PEQ band: log2(freq_peak), bandwidth, gain_peak, with gain_dc 0 and gain_bandwidth half the
+// gain, as new_peq would set it.
+enum { FIT_SHELF_PARAMS = 5, FIT_PEQ_PARAMS = 3 };
+
+typedef struct _fit {
+  t_peqbank *x;
+  t_fit_limits lim;
+  int n;             // Number of frequencies
+  int nshelf;        // Shelf bands come first
+  int nbands;        // Number of bands
+  const float *freqs;
+  const float *target;
+  double *cw;        // Per frequency: cos(w)
+  double *c2w;       // Per frequency: cos(2w)
+  double *p;         // Parameters of all bands
+  float *resp;       // Per band: magnitude in dB at each frequency
+  float *err;        // Target minus the sum of the bands
+  double cost;       // Sum of the squared errors
+  double *jac;       // Per parameter fitted: derivative of the magnitude at each frequency
+  double *trial_p;   // Parameters, magnitudes and errors of a step being tried
+  float *trial_resp;
+  float *trial_err;
+  double *normal;    // Normal equations of a step: J'J, np * np
+  double *damped;    // Their damped copy, factored in place
+  double *grad;      // J' times the error, np
+  double *step;      // Solution of the damped equations, np
+  float *probe;      // Magnitude of a band with one parameter nudged, n
+} t_fit;
+
+static int offset(const t_fit *f, int b) {
+  return b < f->nshelf ? b * FIT_SHELF_PARAMS
+                       : f->nshelf * FIT_SHELF_PARAMS + (b - f->nshelf) * FIT_PEQ_PARAMS;
+}
+
+static int nparams(const t_fit *f, int b) {
+  return b < f->nshelf ? FIT_SHELF_PARAMS : FIT_PEQ_PARAMS;
+}
+
+static double clamp(double v, double lo, double hi) {
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void clamp_band(const t_fit *f, int b, double *q) {
+  double lmin = log2(f->lim.freq_min), lmax = log2(f->lim.freq_max), g = f->lim.gain_max;
+  if (b < f->nshelf) {
+    q[0] = clamp(q[0], lmin, lmax);
+    q[1] = clamp(q[1], q[0], lmax);
+    for (int j = 2; j < FIT_SHELF_PARAMS; j++) q[j] = clamp(q[j], -g, g);
+  } else {
+    q[0] = clamp(q[0], lmin, lmax);
+    q[1] = clamp(q[1], f->lim.bandwidth_min, f->lim.bandwidth_max);
+    q[2] = clamp(q[2], -g, g);
+  }
+}
+
+// Magnitude in dB of one band, from the power response of its section
+static void band_response(const t_fit *f, int b, const double *q, float *mag_db) {
+  float c[NBCOEFF];
+  if (b < f->nshelf) {
+    t_shelf s = {(float)q[2], (float)q[3], (float)q[4], (float)exp2(q[0]), (float)exp2(q[1])};
+    compute_shelf_coeffs(f->x, &s, c);
+  } else if (fabs(q[2]) < FIT_MIN_GAIN) {
+    memset(mag_db, 0, f->n * sizeof(float));
+    return;
+  } else {
+    t_peq p = {(float)exp2(q[0]), (float)q[1], 0.0f, (float)q[2], (float)q[2] * 0.5f};
+    compute_peq_coeffs(f->x, &p, c);
+  }
+
+  double nn = (double)c[0] * c[0] + (double)c[1] * c[1] + (double)c[2] * c[2];
+  double n1 = 2.0 * ((double)c[0] * c[1] + (double)c[1] * c[2]), n2 = 2.0 * (double)c[0] * c[2];
+  double dd = 1.0 + (double)c[3] * c[3] + (double)c[4] * c[4];
+  double d1 = 2.0 * ((double)c[3] + (double)c[3] * c[4]), d2 = 2.0 * (double)c[4];
+  for (int i = 0; i < f->n; i++) {
+    double num = nn + n1 * f->cw[i] + n2 * f->c2w[i];
+    double den = dd + d1 * f->cw[i] + d2 * f->c2w[i];
+    mag_db[i] = (float)(10.0 * log10((num + FIT_EPSILON) / (den + FIT_EPSILON)));
+  }
+}
+
+// Solves a x = y in place of y by Cholesky decomposition of the symmetric positive definite a.
+// Returns -1 if a is not positive definite.
+static int solve(double *a, double *y, int m) {
+  for (int j = 0; j < m; j++) {
+    double d = a[j * m + j];
+    for (int k = 0; k < j; k++) d -= a[j * m + k] * a[j * m + k];
+    if (d <= 0.0) return -1;
+    a[j * m + j] = sqrt(d);
+    for (int i = j + 1; i < m; i++) {
+      double v = a[i * m + j];
+      for (int k = 0; k < j; k++) v -= a[i * m + k] * a[j * m + k];
+      a[i * m + j] = v / a[j * m + j];
+    }
+  }
+  for (int i = 0; i < m; i++) {
+    for (int k = 0; k < i; k++) y[i] -= a[i * m + k] * y[k];
+    y[i] /= a[i * m + i];
+  }
+  for (int i = m - 1; i >= 0; i--) {
+    for (int k = i + 1; k < m; k++) y[i] -= a[k * m + i] * y[k];
+    y[i] /= a[i * m + i];
+  }
+  return 0;
+}
+
+// Levenberg-Marquardt steps over the parameters of bands b0 to b1 - 1, the others staying fixed
+static void refine(t_fit *f, int b0, int b1, int iterations) {
+  int p0 = offset(f, b0), m = offset(f, b1) - p0, n = f->n;
+  double *a = f->normal, *h = f->damped, *g = f->grad, *step = f->step;
+  float *probe = f->probe;
+  double damping = 1e-3;
+
+  for (int it = 0; it < iterations; it++) {
+    // Jacobian of the summed magnitude, by forward differences
+    for (int b = b0; b < b1; b++) {
+      double *q = &f->trial_p[offset(f, b)];
+      for (int j = 0; j < nparams(f, b); j++) {
+        memcpy(q, &f->p[offset(f, b)], nparams(f, b) * sizeof(double));
+        double d = FIT_STEP;
+        q[j] += d;
+        clamp_band(f, b, q);
+        if (q[j] == f->p[offset(f, b) + j]) {
+          q[j] -= d;  // At the upper limit
+          d = -d;
+        }
+        band_response(f, b, q, probe);
+        double *col = &f->jac[(offset(f, b) + j - p0) * n];
+        for (int i = 0; i < n; i++) col[i] = (probe[i] - f->resp[b * n + i]) / d;
+      }
+    }
+    for (int j = 0; j < m; j++) {
+      const double *cj = &f->jac[j * n];
+      g[j] = 0.0;
+      for (int i = 0; i < n; i++) g[j] += cj[i] * f->err[i];
+      for (int k = 0; k <= j; k++) {
+        const double *ck = &f->jac[k * n];
+        double v = 0.0;
+        for (int i = 0; i < n; i++) v += cj[i] * ck[i];
+        a[j * m + k] = a[k * m + j] = v;
+      }
+    }
+
+    // Raise the damping until a step lowers the error
+    int accepted = 0;
+    while (!accepted && damping < FIT_DAMPING_MAX) {
+      memcpy(h, a, m * m * sizeof(double));
+      memcpy(step, g, m * sizeof(double));
+      for (int j = 0; j < m; j++) h[j * m + j] += damping * a[j * m + j] + FIT_EPSILON;
+      if (solve(h, step, m) < 0) {
+        damping *= 10.0;
+        continue;
+      }
+
+      memcpy(f->trial_err, f->target, n * sizeof(float));
+      for (int b = 0; b < f->nbands; b++) {
+        float *r = &f->trial_resp[b * n];
+        if (b >= b0 && b < b1) {
+          int o = offset(f, b);
+          for (int j = 0; j < nparams(f, b); j++) {
+            f->trial_p[o + j] = f->p[o + j] + step[o + j - p0];
+          }
+          clamp_band(f, b, &f->trial_p[o]);
+          band_response(f, b, &f->trial_p[o], r);
+        } else {
+          memcpy(r, &f->resp[b * n], n * sizeof(float));
+        }
+        for (int i = 0; i < n; i++) f->trial_err[i] -= r[i];
+      }
+      double cost = 0.0;
+      for (int i = 0; i < n; i++) cost += (double)f->trial_err[i] * f->trial_err[i];
+
+      if (cost < f->cost) {
+        int converged = f->cost - cost < FIT_TOLERANCE * f->cost;
+        memcpy(&f->p[p0], &f->trial_p[p0], m * sizeof(double));
+        memcpy(&f->resp[b0 * n], &f->trial_resp[b0 * n], (b1 - b0) * n * sizeof(float));
+        memcpy(f->err, f->trial_err, n * sizeof(float));
+        f->cost = cost;
+        damping = fmax(damping * 0.3, 1e-7);
+        accepted = 1;
+        if (converged) return;
+      } else {
+        damping *= 10.0;
+      }
+    }
+    if (!accepted) return;
+  }
+}
+
+static void update_band(t_fit *f, int b) {
+  float *r = &f->resp[b * f->n];
+  band_response(f, b, &f->p[offset(f, b)], r);
+  f->cost = 0.0;
+  for (int i = 0; i < f->n; i++) {
+    f->err[i] -= r[i];
+    f->cost += (double)f->err[i] * f->err[i];
+  }
+}
+
+// Starts a shelf with corners at a quarter and three quarters of the fitted range, and the mean
+// errors below, between and above them as gains
+static void place_shelf(t_fit *f, int b) {
+  double *q = &f->p[offset(f, b)];
+  double lo = log2(fmax(f->freqs[0], f->lim.freq_min));
+  double hi = log2(fmin(f->freqs[f->n - 1], f->lim.freq_max));
+  double sum[3] = {0.0, 0.0, 0.0};
+  int count[3] = {0, 0, 0};
+
+  q[0] = lo + 0.25 * (hi - lo);
+  q[1] = lo + 0.75 * (hi - lo);
+  for (int i = 0; i < f->n; i++) {
+    double l = log2(f->freqs[i]);
+    int region = l < q[0] ? 0 : l > q[1] ? 2 : 1;
+    sum[region] += f->err[i];
+    count[region]++;
+  }
+  for (int j = 0; j < 3; j++) q[2 + j] = count[j] ? sum[j] / count[j] : 0.0;
+  clamp_band(f, b, q);
+}
+
+// Starts a PEQ band on the largest error within the frequency limits, as wide as the part of the
+// error above half of it
+static void place_peq(t_fit *f, int b) {
+  double *q = &f->p[offset(f, b)];
+  int peak = -1;
+  for (int i = 0; i < f->n; i++) {
+    if (f->freqs[i] < f->lim.freq_min || f->freqs[i] > f->lim.freq_max) continue;
+    if (peak < 0 || fabsf(f->err[i]) > fabsf(f->err[peak])) peak = i;
+  }
+  if (peak < 0) peak = f->freqs[0] > f->lim.freq_max ? 0 : f->n - 1;
+
+  float e = f->err[peak];
+  int lo = peak, hi = peak;
+  while (lo > 0 && f->err[lo - 1] * e > 0.25f * e * e) lo--;
+  while (hi < f->n - 1 && f->err[hi + 1] * e > 0.25f * e * e) hi++;
+  q[0] = log2(f->freqs[peak]);
+  q[1] = lo < hi ? log2(f->freqs[hi] / f->freqs[lo]) : f->lim.bandwidth_min;
+  q[2] = e;
+  clamp_band(f, b, q);
+}
+
+t_filter **peqbank_fit(t_peqbank *x,
+                       const float *freqs,
+                       const float *target_db,
+                       int num_freqs,
+                       int num_peq,
+                       int num_shelf,
+                       const t_fit_limits *limits,
+                       float *error_db) {
+  int nbands = num_peq + num_shelf;
+  if (num_freqs < 1 || num_peq < 0 || num_shelf < 0 || nbands < 1 || nbands > MAXELEM) {
+    return NULL;
+  }
+  for (int i = 0; i < num_freqs; i++) {
+    if (freqs[i] <= (i > 0 ? freqs[i - 1] : 0.0f)) return NULL;
+  }
+
+  t_fit f;
+  t_fit_limits defaults = {FIT_FREQ_MIN,
+                           x->b_Fs * FIT_NYQUIST_RATIO,
+                           FIT_GAIN_MAX,
+                           FIT_BANDWIDTH_MIN,
+                           FIT_BANDWIDTH_MAX};
+  f.lim = limits ? *limits : defaults;
+  f.lim.freq_max = fminf(f.lim.freq_max, x->b_Fs * FIT_NYQUIST_RATIO);
+  if (f.lim.freq_min <= 0.0f || f.lim.freq_min > f.lim.freq_max || f.lim.gain_max < 0.0f ||
+      f.lim.bandwidth_min <= 0.0f || f.lim.bandwidth_min > f.lim.bandwidth_max) {
+    return NULL;
+  }
+
+  int n = num_freqs;
+  f.x = x;
+  f.n = n;
+  f.nshelf = num_shelf;
+  f.nbands = nbands;
+  f.freqs = freqs;
+  f.target = target_db;
+  int np = offset(&f, nbands);
+  f.cw = (double *)malloc(n * sizeof(double));
+  f.c2w = (double *)malloc(n * sizeof(double));
+  f.p = (double *)calloc(np, sizeof(double));
+  f.trial_p = (double *)calloc(np, sizeof(double));
+  f.jac = (double *)malloc(np * n * sizeof(double));
+  f.resp = (float *)calloc(nbands * n, sizeof(float));
+  f.trial_resp = (float *)malloc(nbands * n * sizeof(float));
+  f.err = (float *)malloc(n * sizeof(float));
+  f.trial_err = (float *)malloc(n * sizeof(float));
+  f.normal = (double *)malloc(np * np * sizeof(double));
+  f.damped = (double *)malloc(np * np * sizeof(double));
+  f.grad = (double *)malloc(np * sizeof(double));
+  f.step = (double *)malloc(np * sizeof(double));
+  f.probe = (float *)malloc(n * sizeof(float));
+  t_filter **filters = NULL;
+
+  if (f.cw && f.c2w && f.p && f.trial_p && f.jac && f.resp && f.trial_resp && f.err &&
+      f.trial_err && f.normal && f.damped && f.grad && f.step && f.probe) {
+    for (int i = 0; i < n; i++) {
+      double w = TWOPI * freqs[i] / x->b_Fs;
+      f.cw[i] = cos(w);
+      f.c2w[i] = cos(2.0 * w);
+    }
+    memcpy(f.err, target_db, n * sizeof(float));
+
+    // Place the bands one by one on what is left to fit, then refine them all together
+    for (int b = 0; b < nbands; b++) {
+      if (b < num_shelf) {
+        place_shelf(&f, b);
+      } else {
+        place_peq(&f, b);
+      }
+      update_band(&f, b);
+      refine(&f, b, b + 1, FIT_BAND_ITERATIONS);
+    }
+    refine(&f, 0, nbands, FIT_ITERATIONS);
+
+    filters = new_filters(nbands);
+    for (int b = 0; b < nbands; b++) {
+      const double *q = &f.p[offset(&f, b)];
+      if (b < num_shelf) {
+        filters[b] = new_shelf(q[2], q[3], q[4], exp2(q[0]), exp2(q[1]));
+      } else if (fabs(q[2]) < FIT_MIN_GAIN) {
+        filters[b] = new_peq(exp2(q[0]), q[1], 0.0f, 0.0f, 0.0f);
+      } else {
+        filters[b] = new_peq(exp2(q[0]), q[1], 0.0f, q[2], q[2] * 0.5f);
+      }
+    }
+    if (error_db) *error_db = (float)sqrt(f.cost / n);
+  }
+
+  free(f.cw);
+  free(f.c2w);
+  free(f.p);
+  free(f.trial_p);
+  free(f.jac);
+  free(f.resp);
+  free(f.trial_resp);
+  free(f.err);
+  free(f.trial_err);
+  free(f.normal);
+  free(f.damped);
+  free(f.grad);
+  free(f.step);
+  free(f.probe);
+  return filters;
+}
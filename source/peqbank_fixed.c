@@ -0,0 +1,191 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank_fixed.h"
+
+#define FIXED_ONE (1 << FIXED_FRAC)
+#define FIXED_LIMIT (1 << 30)                     // Sample saturation, 8.0 in Q4.27
+#define FIXED_Q31_SHIFT (16 - FIXED_SAMPLE_SHIFT)  // Q1.31 to Q4.27
+
+t_peqbank_fixed *peqbank_fixed_new(t_peqbank *x) {
+  t_peqbank_fixed *f = (t_peqbank_fixed *)malloc(sizeof(t_peqbank_fixed));
+  if (!f) {
+    return NULL;
+  }
+
+  int n = x->b_max * x->b_channels;
+  f->x = x;
+  f->b_channels = x->b_channels;
+  f->b_nbiquads = 0;
+  f->b_coeff = (int32_t *)malloc(n * NBCOEFF * sizeof(int32_t));
+  f->b_shift = (int *)malloc(n * sizeof(int));
+  f->b_state = (int32_t *)malloc(n * 4 * sizeof(int32_t));
+  f->b_err = (int64_t *)malloc(n * sizeof(int64_t));
+  f->s_work = (int32_t *)malloc(FIXED_BLOCK * x->b_channels * sizeof(int32_t));
+  if (!f->b_coeff || !f->b_shift || !f->b_state || !f->b_err || !f->s_work) {
+    peqbank_fixed_free(f);
+    return NULL;
+  }
+  peqbank_fixed_clear(f);
+  // Force quantization on the first call
+  f->b_swaps = x->b_generation - 1;
+  return f;
+}
+
+void peqbank_fixed_free(t_peqbank_fixed *f) {
+  free(f->b_coeff);
+  free(f->b_shift);
+  free(f->b_state);
+  free(f->b_err);
+  free(f->s_work);
+  free(f);
+}
+
+void peqbank_fixed_clear(t_peqbank_fixed *f) {
+  int n = f->x->b_max * f->b_channels;
+  memset(f->b_state, 0, n * 4 * sizeof(int32_t));
+  memset(f->b_err, 0, n * sizeof(int64_t));
+}
+
+static int32_t quantize(double v, int frac) {
+  double q = floor(ldexp(v, frac) + 0.5);
+  return (int32_t)fmax(fmin(q, (double)INT32_MAX), (double)INT32_MIN);
+}
+
+// Quantizes the bank's current coefficients. The numerator of a section whose coefficients reach
+// 2.0 loses as many fraction bits as needed, and the accumulator is scaled back by 2^shift. The
+// state of sections already running is kept, as in FAST mode.
+static void quantize_coeffs(t_peqbank_fixed *f) {
+  t_peqbank *x = f->x;
+  float *coeff = alloca(x->b_max * NBCOEFF * sizeof(float));
+  int nbiquads = 0;
+
+  for (int ch = 0; ch < f->b_channels; ch++) {
+    nbiquads = peqbank_channel_coeffs(x, ch, coeff);
+    for (int k = 0; k < nbiquads; k++) {
+      const float *c = &coeff[k * NBCOEFF];
+      int32_t *q = &f->b_coeff[(ch * x->b_max + k) * NBCOEFF];
+      double peak = fmax(fabs(c[0]), fmax(fabs(c[1]), fabs(c[2])));
+      int shift = 0;
+      while (shift < FIXED_FRAC && ldexp(peak, FIXED_FRAC - shift) >= INT32_MAX) shift++;
+      for (int i = 0; i < 3; i++) q[i] = quantize(c[i], FIXED_FRAC - shift);
+      q[3] = quantize(c[3], FIXED_FRAC);
+      q[4] = quantize(fmax(fmin(c[4], 1), -1), FIXED_FRAC);  // Keeps the accumulator bound
+      f->b_shift[ch * x->b_max + k] = shift;
+    }
+    for (int k = f->b_nbiquads; k < nbiquads; k++) {
+      memset(&f->b_state[(ch * x->b_max + k) * 4], 0, 4 * sizeof(int32_t));
+      f->b_err[ch * x->b_max + k] = 0;
+    }
+  }
+  f->b_nbiquads = nbiquads;
+  f->b_swaps = x->b_generation;
+}
+
+static int32_t saturate(int64_t v, int64_t limit) {
+  return (int32_t)(v > limit ? limit : v < -limit ? -limit : v);
+}
+
+// Runs the cascade in place on n interleaved Q4.27 frames of s_work. Each section accumulates in
+// Q.57 on 64 bits: with samples within +-2^30, |b1| < 2 and |b2| < 1, the denominator is bounded
+// by 1.5 * 2^61 and the numerator is saturated at 2^61 once scaled back, well below 2^63.
+// The output is floored to Q4.27 and the remainder fed back into the next sample.
+static void fixed_cascade(t_peqbank_fixed *f, int n) {
+  int nch = f->b_channels;
+  int nmax = f->x->b_max;
+
+  for (int ch = 0; ch < nch; ch++) {
+    for (int k = 0; k < f->b_nbiquads; k++) {
+      const int32_t *q = &f->b_coeff[(ch * nmax + k) * NBCOEFF];
+      int32_t *state = &f->b_state[(ch * nmax + k) * 4];
+      int shift = f->b_shift[ch * nmax + k];
+      int64_t num_limit = (int64_t)1 << (61 - shift);
+      int64_t xm1 = state[0], xm2 = state[1], ym1 = state[2], ym2 = state[3];
+      int64_t err = f->b_err[ch * nmax + k];
+      int32_t *s = &f->s_work[ch];
+
+      for (int i = 0; i < n; i++, s += nch) {
+        int64_t xn = *s;
+        int64_t num = q[0] * xn + q[1] * xm1 + q[2] * xm2;
+        num = num > num_limit ? num_limit : num < -num_limit ? -num_limit : num;
+        int64_t acc = num * ((int64_t)1 << shift) - q[3] * ym1 - q[4] * ym2 + err;
+        int64_t yn = acc >> FIXED_FRAC;  // Arithmetic shift, rounds towards -inf
+        err = acc - yn * FIXED_ONE;
+        yn = saturate(yn, FIXED_LIMIT);
+        xm2 = xm1;
+        xm1 = xn;
+        ym2 = ym1;
+        ym1 = yn;
+        *s = (int32_t)yn;
+      }
+
+      state[0] = (int32_t)xm1;
+      state[1] = (int32_t)xm2;
+      state[2] = (int32_t)ym1;
+      state[3] = (int32_t)ym2;
+      f->b_err[ch * nmax + k] = err;
+    }
+  }
+}
+
+void peqbank_fixed_int16(t_peqbank_fixed *f,
+                         const int16_t *sig_input,
+                         int16_t *sig_output,
+                         int num_frames) {
+  int nch = f->b_channels;
+  if (f->b_swaps != f->x->b_generation) quantize_coeffs(f);
+
+  for (int done = 0; done < num_frames;) {
+    int n = min(num_frames - done, FIXED_BLOCK);
+    const int16_t *in = &sig_input[done * nch];
+    int16_t *out = &sig_output[done * nch];
+
+    for (int i = 0; i < n * nch; i++) f->s_work[i] = in[i] * (1 << FIXED_SAMPLE_SHIFT);
+    fixed_cascade(f, n);
+    for (int i = 0; i < n * nch; i++) {
+      int32_t v = (f->s_work[i] + (1 << (FIXED_SAMPLE_SHIFT - 1))) >> FIXED_SAMPLE_SHIFT;
+      out[i] = (int16_t)(v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v);
+    }
+    done += n;
+  }
+}
+
+void peqbank_fixed_int32(t_peqbank_fixed *f,
+                         const int32_t *sig_input,
+                         int32_t *sig_output,
+                         int num_frames) {
+  int nch = f->b_channels;
+  if (f->b_swaps != f->x->b_generation) quantize_coeffs(f);
+
+  for (int done = 0; done < num_frames;) {
+    int n = min(num_frames - done, FIXED_BLOCK);
+    const int32_t *in = &sig_input[done * nch];
+    int32_t *out = &sig_output[done * nch];
+
+    for (int i = 0; i < n * nch; i++) {
+      f->s_work[i] = (int32_t)(((int64_t)in[i] + (1 << (FIXED_Q31_SHIFT - 1))) >> FIXED_Q31_SHIFT);
+    }
+    fixed_cascade(f, n);
+    for (int i = 0; i < n * nch; i++) {
+      int64_t v = (int64_t)f->s_work[i] * (1 << FIXED_Q31_SHIFT);
+      out[i] = (int32_t)(v > INT32_MAX ? INT32_MAX : v < INT32_MIN ? INT32_MIN : v);
+    }
+    done += n;
+  }
+}
@@ -0,0 +1,173 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank.h"
+
+#define OPT_GRID 320          // Number of log-spaced frequencies used to measure response error
+#define OPT_FMIN 2.0f         // Lowest frequency of the error grid in Hz, below subsonic filters
+#define OPT_FMAX_RATIO 0.48f  // Highest frequency of the error grid, relative to the sample rate
+
+static void remove_section(float *coeff, int nbiquads, int s) {
+  memmove(&coeff[s * NBCOEFF],
+          &coeff[(s + 1) * NBCOEFF],
+          (nbiquads - s - 1) * NBCOEFF * sizeof(float));
+}
+
+// A section is a pure gain when its numerator is a scaled copy of its denominator.
+static int is_identity(const float *c, float tolerance) {
+  return fabsf(c[1] - c[0] * c[3]) <= tolerance && fabsf(c[2] - c[0] * c[4]) <= tolerance;
+}
+
+// The normalized numerator of a cancels the denominator of b.
+static int cancels(const float *a, const float *b, float tolerance) {
+  if (fabsf(a[0]) < SMALL) return 0;
+  return fabsf(a[1] / a[0] - b[3]) <= tolerance && fabsf(a[2] / a[0] - b[4]) <= tolerance;
+}
+
+static int prune_exact(float *coeff, int nbiquads, float tolerance, float *gain) {
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+
+    for (int s = 0; s < nbiquads; s++) {
+      float *c = &coeff[s * NBCOEFF];
+      if (is_identity(c, tolerance)) {
+        *gain *= c[0];
+        remove_section(coeff, nbiquads--, s--);
+        changed = 1;
+      }
+    }
+
+    for (int i = 0; i < nbiquads && !changed; i++) {
+      for (int j = 0; j < nbiquads && !changed; j++) {
+        float *a = &coeff[i * NBCOEFF];
+        float *b = &coeff[j * NBCOEFF];
+        if (i == j || !cancels(a, b, tolerance)) continue;
+        // (a0 * D_j / D_i) * (N_j / D_j) = a0 * N_j / D_i
+        a[1] = a[0] * b[1];
+        a[2] = a[0] * b[2];
+        a[0] = a[0] * b[0];
+        remove_section(coeff, nbiquads--, j);
+        changed = 1;
+      }
+    }
+  }
+  return nbiquads;
+}
+
+// Greedily drops the section whose removal, after the best compensating gain, leaves the smallest
+// peak error against the original cascade, as long as that error stays below max_error_db.
+static int prune_approximate(
+    float *coeff, int nbiquads, float sampling_rate, float max_error_db, float *gain) {
+  float *freqs = (float *)malloc(OPT_GRID * sizeof(float));
+  float *total = (float *)malloc(OPT_GRID * sizeof(float));
+  float *sections = (float *)malloc(nbiquads * OPT_GRID * sizeof(float));
+  if (freqs == NULL || total == NULL || sections == NULL) {
+    free(freqs);
+    free(total);
+    free(sections);
+    return nbiquads;
+  }
+
+  float fmax = OPT_FMAX_RATIO * sampling_rate;
+  for (int i = 0; i < OPT_GRID; i++) {
+    freqs[i] = OPT_FMIN * powf(fmax / OPT_FMIN, (float)i / (OPT_GRID - 1));
+    total[i] = 0.0f;  // running error of the approximation, in dB
+  }
+  for (int s = 0; s < nbiquads; s++) {
+    peqbank_response_coeffs(&coeff[s * NBCOEFF],
+                            1,
+                            sampling_rate,
+                            freqs,
+                            OPT_GRID,
+                            &sections[s * OPT_GRID],
+                            NULL,
+                            NULL);
+  }
+
+  while (nbiquads > 0) {
+    int best = -1;
+    float best_err = max_error_db;
+    float best_offset = 0.0f;
+    for (int s = 0; s < nbiquads; s++) {
+      float lo = INFINITY, hi = -INFINITY;
+      for (int i = 0; i < OPT_GRID; i++) {
+        float e = total[i] + sections[s * OPT_GRID + i];
+        lo = min(lo, e);
+        hi = max(hi, e);
+      }
+      if ((hi - lo) * 0.5f <= best_err) {
+        best = s;
+        best_err = (hi - lo) * 0.5f;
+        best_offset = (hi + lo) * 0.5f;
+      }
+    }
+    if (best < 0) break;
+
+    for (int i = 0; i < OPT_GRID; i++) total[i] += sections[best * OPT_GRID + i] - best_offset;
+    *gain *= peqbank_pow10(best_offset * 0.05f);
+    remove_section(coeff, nbiquads, best);
+    memmove(&sections[best * OPT_GRID],
+            &sections[(best + 1) * OPT_GRID],
+            (nbiquads - best - 1) * OPT_GRID * sizeof(float));
+    nbiquads--;
+  }
+
+  free(freqs);
+  free(total);
+  free(sections);
+  return nbiquads;
+}
+
+int peqbank_optimize_coeffs(
+    float *coeff, int nbiquads, float sampling_rate, float tolerance, float max_error_db) {
+  float gain = 1.0f;
+
+  nbiquads = prune_exact(coeff, nbiquads, tolerance, &gain);
+  if (max_error_db > 0.0f) {
+    nbiquads = prune_approximate(coeff, nbiquads, sampling_rate, max_error_db, &gain);
+  }
+
+  // Fold the gain of the removed sections into the first remaining numerator
+  if (nbiquads > 0) {
+    coeff[0] *= gain;
+    coeff[1] *= gain;
+    coeff[2] *= gain;
+  } else if (fabsf(gain - 1.0f) > tolerance) {
+    coeff[0] = gain;
+    coeff[1] = coeff[2] = coeff[3] = coeff[4] = 0.0f;
+    nbiquads = 1;
+  }
+  return nbiquads;
+}
+
+void peqbank_set_optimize(t_peqbank *x, float tolerance, float max_error_db) {
+  peqbank_free_rate_sets(x);  // precomputed with the previous settings
+  x->b_opt_tolerance = tolerance;
+  x->b_opt_max_error = max_error_db;
+}
+
+void peqbank_set_headroom(t_peqbank *x, int enabled) {
+  peqbank_free_rate_sets(x);  // precomputed with the previous settings
+  x->b_headroom_auto = enabled;
+}
+
+float peqbank_get_headroom(t_peqbank *x) {
+  return x->b_headroom;
+}
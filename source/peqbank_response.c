@@ -0,0 +1,232 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank.h"
+
+// Frequencies are evaluated in chunks so that the per-frequency work arrays stay on the stack and
+// the inner loops (one per biquad) run over contiguous memory.
+#define RESPONSE_CHUNK 64
+#define RESPONSE_EPSILON 1e-30
+#define DECAY_MARGIN 8       // Simulated length, in multiples of the single-pole estimate
+#define DECAY_MIN 1024       // Shortest simulated length, for sections with coincident poles
+#define DECAY_MAX (1 << 22)  // Longest tail considered, about 95 s at 44.1 kHz
+#define PEAK_GRID 512        // Log-spaced frequencies searched for the peak gain, plus DC
+#define PEAK_FMIN 10.0f      // Lowest non-zero frequency of that grid in Hz
+#define PEAK_REFINE 24       // Golden-section steps around the highest grid point
+
+void peqbank_response_coeffs(const float *coeff,
+                             int nbiquads,
+                             float sampling_rate,
+                             const float *freqs,
+                             int num_freqs,
+                             float *mag_db,
+                             float *phase,
+                             float *group_delay) {
+  double c1[RESPONSE_CHUNK], s1[RESPONSE_CHUNK], c2[RESPONSE_CHUNK], s2[RESPONSE_CHUNK];
+  double hr[RESPONSE_CHUNK], hi[RESPONSE_CHUNK], pw[RESPONSE_CHUNK], gd[RESPONSE_CHUNK];
+  double w_scale = 2.0 * M_PI / sampling_rate;
+
+  for (int f0 = 0; f0 < num_freqs; f0 += RESPONSE_CHUNK) {
+    int m = min(RESPONSE_CHUNK, num_freqs - f0);
+
+    for (int i = 0; i < m; i++) {
+      double w = freqs[f0 + i] * w_scale;
+      c1[i] = cos(w);
+      s1[i] = sin(w);
+      c2[i] = 2.0 * c1[i] * c1[i] - 1.0;
+      s2[i] = 2.0 * s1[i] * c1[i];
+      hr[i] = 1.0;
+      hi[i] = 0.0;
+      pw[i] = 1.0;
+      gd[i] = 0.0;
+    }
+
+    // H(z) = (a0 + a1 z^-1 + a2 z^-2) / (1 + b1 z^-1 + b2 z^-2), evaluated on z = e^jw
+    for (int j = 0; j < nbiquads * NBCOEFF; j += NBCOEFF) {
+      double a0 = coeff[j];
+      double a1 = coeff[j + 1];
+      double a2 = coeff[j + 2];
+      double b1 = coeff[j + 3];
+      double b2 = coeff[j + 4];
+
+      for (int i = 0; i < m; i++) {
+        double nr = a0 + a1 * c1[i] + a2 * c2[i];
+        double ni = -(a1 * s1[i] + a2 * s2[i]);
+        double dr = 1.0 + b1 * c1[i] + b2 * c2[i];
+        double di = -(b1 * s1[i] + b2 * s2[i]);
+        double n2 = nr * nr + ni * ni + RESPONSE_EPSILON;
+        double d2 = dr * dr + di * di + RESPONSE_EPSILON;
+
+        // Accumulate H as a complex product N/D = N * conj(D) / |D|^2
+        double qr = (nr * dr + ni * di) / d2;
+        double qi = (ni * dr - nr * di) / d2;
+        double tr = hr[i] * qr - hi[i] * qi;
+        hi[i] = hr[i] * qi + hi[i] * qr;
+        hr[i] = tr;
+        pw[i] *= n2 / d2;
+
+        // Group delay of a polynomial P = sum(c_k e^-jkw) is Re(sum(k c_k e^-jkw) / P)
+        double tnr = a1 * c1[i] + 2.0 * a2 * c2[i];
+        double tni = -(a1 * s1[i] + 2.0 * a2 * s2[i]);
+        double tdr = b1 * c1[i] + 2.0 * b2 * c2[i];
+        double tdi = -(b1 * s1[i] + 2.0 * b2 * s2[i]);
+        gd[i] += (tnr * nr + tni * ni) / n2 - (tdr * dr + tdi * di) / d2;
+      }
+    }
+
+    if (mag_db) {
+      for (int i = 0; i < m; i++) mag_db[f0 + i] = (float)(10.0 * log10(pw[i] + RESPONSE_EPSILON));
+    }
+    if (phase) {
+      for (int i = 0; i < m; i++) phase[f0 + i] = (float)atan2(hi[i], hr[i]);
+    }
+    if (group_delay) {
+      for (int i = 0; i < m; i++) group_delay[f0 + i] = (float)gd[i];
+    }
+  }
+}
+
+void peqbank_response(t_peqbank *x,
+                      const float *freqs,
+                      int num_freqs,
+                      float *mag_db,
+                      float *phase,
+                      float *group_delay) {
+  float coeff[MAXELEM * NBCOEFF];
+  int nbiquads = peqbank_channel_coeffs(x, 0, coeff);
+  peqbank_response_coeffs(coeff, nbiquads, x->b_Fs, freqs, num_freqs, mag_db, phase, group_delay);
+}
+
+static float magnitude_db(const float *coeff, int nbiquads, float sampling_rate, float freq) {
+  float mag_db;
+  peqbank_response_coeffs(coeff, nbiquads, sampling_rate, &freq, 1, &mag_db, NULL, NULL);
+  return mag_db;
+}
+
+float peqbank_peak_gain_coeffs(const float *coeff, int nbiquads, float sampling_rate) {
+  float freqs[PEAK_GRID + 1], mag_db[PEAK_GRID + 1];
+  float nyquist = sampling_rate * 0.5f;
+  float ratio = powf(nyquist / PEAK_FMIN, 1.0f / (PEAK_GRID - 1));
+
+  freqs[0] = 0.0f;
+  freqs[1] = PEAK_FMIN;
+  for (int i = 2; i <= PEAK_GRID; i++) freqs[i] = freqs[i - 1] * ratio;
+  freqs[PEAK_GRID] = nyquist;
+  peqbank_response_coeffs(coeff, nbiquads, sampling_rate, freqs, PEAK_GRID + 1, mag_db, NULL, NULL);
+
+  int best = 0;
+  for (int i = 1; i <= PEAK_GRID; i++) {
+    if (mag_db[i] > mag_db[best]) best = i;
+  }
+
+  // The peak lies between the neighbours of the highest grid point
+  const float golden = 0.618034f;
+  float lo = freqs[max(best - 1, 0)], hi = freqs[min(best + 1, PEAK_GRID)];
+  float peak = mag_db[best];
+  for (int i = 0; i < PEAK_REFINE; i++) {
+    float f1 = hi - golden * (hi - lo), f2 = lo + golden * (hi - lo);
+    float m1 = magnitude_db(coeff, nbiquads, sampling_rate, f1);
+    float m2 = magnitude_db(coeff, nbiquads, sampling_rate, f2);
+    peak = fmaxf(peak, fmaxf(m1, m2));
+    if (m1 > m2) {
+      hi = f2;
+    } else {
+      lo = f1;
+    }
+  }
+  return peak;
+}
+
+// Largest pole radius of one section, from the roots of z^2 + b1 z + b2
+static double pole_radius(const float *c) {
+  double b1 = c[3], b2 = c[4];
+  double disc = b1 * b1 - 4.0 * b2;
+  if (disc < 0.0) return sqrt(b2);
+  return (fabs(b1) + sqrt(disc)) * 0.5;
+}
+
+// Runs the impulse response of sections first and up for at most len samples, and returns the
+// number of samples after which the running sum of |h[n]| reaches target (len if it never does).
+// The sum itself is stored in *l1.
+static int impulse_l1(const float *coeff,
+                      int first,
+                      int nbiquads,
+                      int len,
+                      double target,
+                      double *state,
+                      double *l1) {
+  double sum = 0.0;
+  int n = 0;
+  memset(state, 0, nbiquads * 4 * sizeof(double));
+  for (; n < len && sum < target; n++) {
+    double v = n == 0 ? 1.0 : 0.0;
+    for (int k = first; k < nbiquads; k++) {
+      const float *c = &coeff[k * NBCOEFF];
+      double *s = &state[k * 4];  // x1, x2, y1, y2
+      double y = c[0] * v + c[1] * s[0] + c[2] * s[1] - c[3] * s[2] - c[4] * s[3];
+      s[1] = s[0];
+      s[0] = v;
+      s[3] = s[2];
+      s[2] = y;
+      v = y;
+    }
+    sum += fabs(v);
+  }
+  *l1 = sum;
+  return n;
+}
+
+int peqbank_decay_length_coeffs(const float *coeff, int nbiquads, float eps) {
+  double rmax = 0.0;
+  for (int k = 0; k < nbiquads; k++) rmax = fmax(rmax, pole_radius(&coeff[k * NBCOEFF]));
+  if (rmax >= 1.0) return -1;
+  if (rmax <= 0.0) return 2 * nbiquads;  // FIR sections only
+
+  // The error left by a missing past is the input convolved with the tail of the impulse
+  // response, so for input within full scale it is bounded by the L1 norm of that tail. A single
+  // pole decays below eps after log(eps) / log(r) samples; coincident poles and resonant gains
+  // stretch that, so the response is simulated over a multiple of this estimate. A state left in
+  // section k only excites sections k and up, so every sub-cascade is checked.
+  double estimate = log(eps) / log(rmax);
+  int len = (int)min(estimate * DECAY_MARGIN + DECAY_MIN, (double)DECAY_MAX);
+  double *state = (double *)malloc(nbiquads * 4 * sizeof(double));
+  if (state == NULL) return len;
+
+  int length = 0;
+  for (int first = 0; first < nbiquads; first++) {
+    double total, sum;
+    impulse_l1(coeff, first, nbiquads, len, INFINITY, state, &total);
+    length = max(length, impulse_l1(coeff, first, nbiquads, len, total - eps, state, &sum));
+  }
+  free(state);
+  return length;
+}
+
+int peqbank_decay_length(t_peqbank *x, float eps) {
+  float coeff[MAXELEM * NBCOEFF];
+  int length = 0;
+  int channels = x->b_chfilters ? x->b_channels : 1;
+  for (int c = 0; c < channels; c++) {
+    int nbiquads = peqbank_channel_coeffs(x, c, coeff);
+    int n = peqbank_decay_length_coeffs(coeff, nbiquads, eps);
+    if (n < 0) return -1;
+    length = max(length, n);
+  }
+  return length;
+}
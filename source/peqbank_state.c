@@ -0,0 +1,230 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "PeqBank/peqbank.h"
+
+#define STATE_MAGIC 0x53514550u  // "PEQS" in little-endian byte order
+
+// Fixed part of a snapshot. The arrays follow, trimmed to the sections in use:
+// coeff, oldcoeff (if a ramp is pending), xm1, xm2, ym1, ym2, settled, then when fading the faded
+// cascade's coefficients and state, then the look-ahead delay line, then with dynamic bands the
+// state of every position of their lists.
+typedef struct _state_header {
+  uint32_t magic;
+  uint32_t version;
+  int32_t channels;
+  int32_t nbiquads;
+  int32_t ndesigned;
+  int32_t flat;
+  int32_t optimized;
+  int32_t per_channel;
+  int32_t topology;
+  int32_t pending;  // Set when oldcoeff differs from coeff, i.e. a SMOOTH ramp is under way
+  int32_t ramp_left;
+  int32_t fade_left;
+  int32_t fade_len;
+  int32_t fade_nbiquads;
+  int32_t fade_per_channel;
+  int32_t lookahead;
+  int32_t ndynamic;  // Dynamic band states that follow, MAXELEM per list when there are any
+  int32_t control_left;
+  int32_t limit_pos;
+  int32_t limit_hold;
+  float fs;
+  float limit_gain;
+  float limit_target;
+  float limit_next;
+  float limit_step;
+} t_state_header;
+
+// Reads or writes a byte stream, or only measures it when buf is NULL
+typedef struct _state_cursor {
+  uint8_t *buf;
+  size_t size;
+  size_t used;
+} t_state_cursor;
+
+static void put(t_state_cursor *s, const void *src, size_t n) {
+  if (s->buf && s->used + n <= s->size) memcpy(s->buf + s->used, src, n);
+  s->used += n;
+}
+
+static int get(t_state_cursor *s, void *dst, size_t n) {
+  if (s->used + n > s->size) return -1;
+  memcpy(dst, s->buf + s->used, n);
+  s->used += n;
+  return 0;
+}
+
+static int width(t_peqbank *x, int per_channel) {
+  return per_channel ? x->b_channels : 1;
+}
+
+static int dynamic_states(t_peqbank *x) {
+  return x->b_dynamic ? MAXELEM * width(x, x->b_chfilters != NULL) : 0;
+}
+
+static size_t save(t_peqbank *x, t_state_cursor *s) {
+  int nch = x->b_channels;
+  int nb = x->b_max * nch;
+  t_state_header h;
+
+  memset(&h, 0, sizeof(h));
+  h.magic = STATE_MAGIC;
+  h.version = PEQBANK_STATE_VERSION;
+  h.channels = nch;
+  h.nbiquads = x->b_nbiquads;
+  h.ndesigned = x->b_ndesigned;
+  h.flat = x->b_flat;
+  h.optimized = x->b_optimized;
+  h.per_channel = x->b_chfilters != NULL;
+  h.topology = x->b_topology;
+  h.pending = x->coeff != x->oldcoeff;
+  h.ramp_left = h.pending ? x->b_ramp_left : 0;
+  h.fade_left = x->b_fade_left;
+  h.fade_len = x->b_fade_len;
+  h.fade_nbiquads = x->b_fade_left > 0 ? x->b_fade_nbiquads : 0;
+  h.fade_per_channel = x->b_fade_per_channel;
+  h.lookahead = x->b_limit_delay ? x->b_lookahead : 0;
+  h.ndynamic = dynamic_states(x);
+  h.control_left = x->b_control_left;
+  h.limit_pos = x->b_limit_pos;
+  h.limit_hold = x->b_limit_hold;
+  h.fs = x->b_Fs;
+  h.limit_gain = x->b_limit_gain;
+  h.limit_target = x->b_limit_target;
+  h.limit_next = x->b_limit_next;
+  h.limit_step = x->b_limit_step;
+  put(s, &h, sizeof(h));
+
+  size_t ncoeff = h.nbiquads * NBCOEFF * width(x, h.per_channel) * sizeof(float);
+  size_t nstate = h.nbiquads * nch * sizeof(float);
+  put(s, x->coeff, ncoeff);
+  if (h.pending) put(s, x->oldcoeff, ncoeff);
+  put(s, x->b_xm1, nstate);
+  put(s, x->b_xm2, nstate);
+  put(s, x->b_ym1, nstate);
+  put(s, x->b_ym2, nstate);
+  put(s, x->b_settled, nch * sizeof(int));
+
+  if (h.fade_nbiquads > 0) {
+    size_t nfade = h.fade_nbiquads * nch * sizeof(float);
+    size_t nfadecoeff = h.fade_nbiquads * NBCOEFF * width(x, h.fade_per_channel) * sizeof(float);
+    put(s, x->b_fade_coeff, nfadecoeff);
+    for (int i = 0; i < 4; i++) put(s, x->b_fade_state + i * nb, nfade);
+  }
+  if (h.lookahead > 0) put(s, x->b_limit_delay, h.lookahead * nch * sizeof(float));
+  put(s, x->b_dynamic_state, h.ndynamic * sizeof(t_dynamic_state));
+  return s->used;
+}
+
+size_t peqbank_state_size(t_peqbank *x) {
+  t_state_cursor s = {NULL, 0, 0};
+  return save(x, &s);
+}
+
+int peqbank_save_state(t_peqbank *x, void *buf, size_t size) {
+  t_state_cursor s = {(uint8_t *)buf, size, 0};
+  size_t used = save(x, &s);
+  return used <= size ? (int)used : -1;
+}
+
+int peqbank_load_state(t_peqbank *x, const void *buf, size_t size) {
+  t_state_cursor s = {(uint8_t *)buf, size, 0};
+  int nch = x->b_channels;
+  int nb = x->b_max * nch;
+  t_state_header h;
+
+  // Check everything before touching the bank, so that a rejected snapshot changes nothing
+  if (get(&s, &h, sizeof(h)) < 0 || h.magic != STATE_MAGIC || h.version != PEQBANK_STATE_VERSION) {
+    return -1;
+  }
+  if (h.channels != nch || h.fs != x->b_Fs || h.per_channel != (x->b_chfilters != NULL) ||
+      h.topology != x->b_topology || h.lookahead != (x->b_limit_delay ? x->b_lookahead : 0) ||
+      h.ndynamic != dynamic_states(x)) {
+    return -1;
+  }
+  if (h.nbiquads < 0 || h.nbiquads > x->b_max || h.fade_nbiquads < 0 ||
+      h.fade_nbiquads > x->b_max || h.ramp_left < 0 || h.fade_left < 0 ||
+      h.fade_left > h.fade_len) {
+    return -1;
+  }
+  // Positions and countdowns index buffers and split blocks: out of range, they corrupt memory
+  if (h.limit_pos < 0 || h.limit_pos >= max(h.lookahead, 1) || h.limit_hold < 0 ||
+      h.limit_hold > h.lookahead + 1 || h.control_left <= 0 || h.control_left > x->b_control) {
+    return -1;
+  }
+  size_t ncoeff = h.nbiquads * NBCOEFF * width(x, h.per_channel) * sizeof(float);
+  size_t nstate = h.nbiquads * nch * sizeof(float);
+  size_t nfade = h.fade_nbiquads * nch * sizeof(float);
+  size_t nfadecoeff = h.fade_nbiquads * NBCOEFF * width(x, h.fade_per_channel) * sizeof(float);
+  size_t expected = sizeof(h) + ncoeff * (h.pending ? 2 : 1) + 4 * nstate + nch * sizeof(int) +
+                    nfadecoeff + 4 * nfade + h.lookahead * nch * sizeof(float) +
+                    h.ndynamic * sizeof(t_dynamic_state);
+  if (size < expected) return -1;
+
+  // Settle the coefficient pointers (see peqbank_perform_fast), then rebuild a pending ramp with
+  // freecoeff lent to oldcoeff, as swap_in_new_coeffs would leave it
+  if (x->coeff != x->oldcoeff) {
+    x->freecoeff = x->oldcoeff;
+    x->oldcoeff = x->coeff;
+  }
+  get(&s, x->coeff, ncoeff);
+  if (h.pending) {
+    get(&s, x->freecoeff, ncoeff);
+    x->oldcoeff = x->freecoeff;
+    x->freecoeff = 0;
+  }
+  x->b_nbiquads = h.nbiquads;
+  x->b_ndesigned = h.ndesigned;
+  x->b_flat = h.flat;
+  x->b_optimized = h.optimized;
+  x->b_ramp_left = h.ramp_left;
+  x->b_generation++;  // for the fixed-point engine
+  x->b_ramp_swap = x->b_generation;
+  x->b_nevents = 0;
+
+  peqbank_clear(x);
+  get(&s, x->b_xm1, nstate);
+  get(&s, x->b_xm2, nstate);
+  get(&s, x->b_ym1, nstate);
+  get(&s, x->b_ym2, nstate);
+  get(&s, x->b_settled, nch * sizeof(int));
+
+  x->b_fade_left = h.fade_left;
+  x->b_fade_len = h.fade_len;
+  x->b_fade_nbiquads = h.fade_nbiquads;
+  x->b_fade_per_channel = h.fade_per_channel;
+  if (h.fade_nbiquads > 0) {
+    get(&s, x->b_fade_coeff, nfadecoeff);
+    for (int i = 0; i < 4; i++) get(&s, x->b_fade_state + i * nb, nfade);
+  }
+
+  if (h.lookahead > 0) get(&s, x->b_limit_delay, h.lookahead * nch * sizeof(float));
+  x->b_limit_pos = h.limit_pos;
+  x->b_limit_hold = h.limit_hold;
+  x->b_limit_gain = h.limit_gain;
+  x->b_limit_target = h.limit_target;
+  x->b_limit_next = h.limit_next;
+  x->b_limit_step = h.limit_step;
+
+  get(&s, x->b_dynamic_state, h.ndynamic * sizeof(t_dynamic_state));
+  x->b_control_left = h.control_left;
+  return 0;
+}
@@ -0,0 +1,528 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#define _FILE_OFFSET_BITS 64
+
+#include "render.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#define RENDER_OUT_BUFFER (1 << 20)  // stdio buffer of the output file
+#define RENDER_RELEASE (64 << 20)    // Mapped input is dropped from memory in steps of this size
+#define RENDER_QUEUE 8               // Blocks in flight in the pipelined mode
+#define RENDER_SPINS 64              // Polls of an empty or full queue before sleeping
+#define RENDER_SLEEP_NS 20000        // Sleep between polls after that
+#define RENDER_MAX_SEGMENTS 256
+
+// Input is mapped when possible and read block by block otherwise (Windows, 32-bit address space
+// exhausted, pipes). Either way the caller gets a pointer to the next block.
+typedef struct _render_input {
+  FILE *file;
+  const char *map;
+  int64_t size;
+  int64_t pos;
+  int64_t released;
+  char *buf;
+} t_render_input;
+
+static int input_open(t_render_input *in, const char *path, size_t block_bytes) {
+  memset(in, 0, sizeof(*in));
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+      in->map = (const char *)map;
+      in->size = st.st_size;
+    }
+  }
+  close(fd);
+  if (in->map) return 0;
+#endif
+  in->file = fopen(path, "rb");
+  in->buf = (char *)malloc(block_bytes);
+  if (in->file == NULL || in->buf == NULL) {
+    if (in->file) fclose(in->file);
+    free(in->buf);
+    return -1;
+  }
+  return 0;
+}
+
+// Returns the number of bytes available at *data, at most max_bytes, 0 at the end of the input
+static size_t input_next(t_render_input *in, const void **data, size_t max_bytes) {
+  if (in->file) {
+    *data = in->buf;
+    return fread(in->buf, 1, max_bytes, in->file);
+  }
+#ifndef _WIN32
+  // Pages already processed are not needed again
+  if (in->pos - in->released >= RENDER_RELEASE) {
+    madvise((void *)(in->map + in->released), RENDER_RELEASE, MADV_DONTNEED);
+    in->released += RENDER_RELEASE;
+  }
+#endif
+  size_t n = (size_t)min((int64_t)max_bytes, in->size - in->pos);
+  *data = in->map + in->pos;
+  in->pos += n;
+  return n;
+}
+
+// Copies the next block into dst. With a mapped input this is where the pages are faulted in.
+static size_t input_read(t_render_input *in, void *dst, size_t max_bytes) {
+  const void *data;
+  if (in->file) return fread(dst, 1, max_bytes, in->file);
+  size_t n = input_next(in, &data, max_bytes);
+  memcpy(dst, data, n);
+  return n;
+}
+
+static void input_close(t_render_input *in) {
+#ifndef _WIN32
+  if (in->map) munmap((void *)in->map, (size_t)in->size);
+#endif
+  if (in->file) fclose(in->file);
+  free(in->buf);
+}
+
+int render_parse_format(const char *name) {
+  if (strcmp(name, "s16") == 0) return RENDER_S16;
+  if (strcmp(name, "f32") == 0) return RENDER_F32;
+  return -1;
+}
+
+int render_frame_bytes(const t_render_config *cfg) {
+  return cfg->channels * (int)(cfg->format == RENDER_S16 ? sizeof(int16_t) : sizeof(float));
+}
+
+static void process_block(t_peqbank *x, int format, const void *in, void *out, int n) {
+  x->s_n = n;
+  if (format == RENDER_S16) {
+    peqbank_callback_int16(x, (int16_t *)in, (int16_t *)out);
+  } else {
+    peqbank_callback_float(x, (float *)in, (float *)out);
+  }
+}
+
+static int render_serial(const t_render_config *cfg,
+                         t_render_input *in,
+                         FILE *out,
+                         t_peqbank *x,
+                         t_render_result *result) {
+  int frame_bytes = render_frame_bytes(cfg);
+  size_t block_bytes = (size_t)cfg->block * frame_bytes;
+  void *block_out = malloc(block_bytes);
+  if (block_out == NULL) return -1;
+
+  int err = 0;
+  const void *block_in;
+  size_t bytes;
+  while ((bytes = input_next(in, &block_in, block_bytes)) > 0) {
+    int n = (int)(bytes / frame_bytes);
+    if (n > 0) {
+      int64_t t0 = peqbank_clock_ns();
+      process_block(x, cfg->format, block_in, block_out, n);
+      int64_t t1 = peqbank_clock_ns();
+      size_t written = fwrite(block_out, frame_bytes, n, out);
+      result->process_ns += t1 - t0;
+      result->write_ns += peqbank_clock_ns() - t1;
+      if (written != (size_t)n) {
+        fprintf(stderr, "Cannot write %s\n", cfg->out_path);
+        err = -1;
+        break;
+      }
+      result->frames += n;
+    }
+    if (bytes % frame_bytes) {
+      fprintf(stderr, "Warning: ignoring a trailing partial frame in %s\n", cfg->in_path);
+      break;
+    }
+  }
+  free(block_out);
+  return err;
+}
+
+#ifndef _WIN32
+// Pipelined rendering: a reader thread, the processing (calling) thread and a writer thread pass
+// a fixed set of blocks around a ring of single-producer single-consumer queues:
+// free -> reader -> full -> processor -> done -> writer -> free. A block with no frames marks the
+// end of the stream.
+
+typedef struct _render_block {
+  void *in;
+  void *out;
+  int frames;
+} t_render_block;
+
+typedef struct _render_queue {
+  t_render_block *slots[RENDER_QUEUE];
+  atomic_uint head;  // Next slot to pop, written by the consumer only
+  atomic_uint tail;  // Next slot to push, written by the producer only
+} t_render_queue;
+
+typedef struct _render_pipeline {
+  const t_render_config *cfg;
+  t_render_input *in;
+  FILE *out;
+  t_render_queue free_q;
+  t_render_queue full_q;
+  t_render_queue done_q;
+  atomic_int failed;
+  int64_t read_ns;
+  int64_t write_ns;
+} t_render_pipeline;
+
+static void queue_wait(int *spins) {
+  if (++*spins < RENDER_SPINS) return;
+  struct timespec ts = {0, RENDER_SLEEP_NS};
+  nanosleep(&ts, NULL);
+}
+
+static int queue_push(t_render_pipeline *p, t_render_queue *q, t_render_block *b) {
+  unsigned t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  int spins = 0;
+  while (t - atomic_load_explicit(&q->head, memory_order_acquire) == RENDER_QUEUE) {
+    if (atomic_load_explicit(&p->failed, memory_order_relaxed)) return 0;
+    queue_wait(&spins);
+  }
+  q->slots[t % RENDER_QUEUE] = b;
+  atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+  return 1;
+}
+
+static t_render_block *queue_pop(t_render_pipeline *p, t_render_queue *q) {
+  unsigned h = atomic_load_explicit(&q->head, memory_order_relaxed);
+  int spins = 0;
+  while (atomic_load_explicit(&q->tail, memory_order_acquire) == h) {
+    if (atomic_load_explicit(&p->failed, memory_order_relaxed)) return NULL;
+    queue_wait(&spins);
+  }
+  t_render_block *b = q->slots[h % RENDER_QUEUE];
+  atomic_store_explicit(&q->head, h + 1, memory_order_release);
+  return b;
+}
+
+static void *reader_main(void *arg) {
+  t_render_pipeline *p = (t_render_pipeline *)arg;
+  int frame_bytes = render_frame_bytes(p->cfg);
+  size_t block_bytes = (size_t)p->cfg->block * frame_bytes;
+  t_render_block *b;
+  while ((b = queue_pop(p, &p->free_q)) != NULL) {
+    int64_t t0 = peqbank_clock_ns();
+    size_t bytes = input_read(p->in, b->in, block_bytes);
+    p->read_ns += peqbank_clock_ns() - t0;
+    int frames = (int)(bytes / frame_bytes);
+    b->frames = frames;
+    if (bytes % frame_bytes) {
+      fprintf(stderr, "Warning: ignoring a trailing partial frame in %s\n", p->cfg->in_path);
+      bytes = 0;  // end the stream after this block
+    }
+    if (!queue_push(p, &p->full_q, b)) break;
+    if (bytes < block_bytes) {
+      // Short read: end of input. Follow with an empty block unless this one already is.
+      if (frames == 0) break;
+      if ((b = queue_pop(p, &p->free_q)) == NULL) break;
+      b->frames = 0;
+      queue_push(p, &p->full_q, b);
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void *writer_main(void *arg) {
+  t_render_pipeline *p = (t_render_pipeline *)arg;
+  int frame_bytes = render_frame_bytes(p->cfg);
+  t_render_block *b;
+  while ((b = queue_pop(p, &p->done_q)) != NULL && b->frames > 0) {
+    int64_t t0 = peqbank_clock_ns();
+    size_t written = fwrite(b->out, frame_bytes, b->frames, p->out);
+    p->write_ns += peqbank_clock_ns() - t0;
+    if (written != (size_t)b->frames) {
+      fprintf(stderr, "Cannot write %s\n", p->cfg->out_path);
+      atomic_store(&p->failed, 1);
+      break;
+    }
+    if (!queue_push(p, &p->free_q, b)) break;
+  }
+  return NULL;
+}
+
+static int render_pipelined(const t_render_config *cfg,
+                            t_render_input *in,
+                            FILE *out,
+                            t_peqbank *x,
+                            t_render_result *result) {
+  size_t block_bytes = (size_t)cfg->block * render_frame_bytes(cfg);
+  t_render_pipeline *p = (t_render_pipeline *)calloc(1, sizeof(t_render_pipeline));
+  t_render_block *blocks = (t_render_block *)calloc(RENDER_QUEUE, sizeof(t_render_block));
+  char *mem = (char *)malloc(RENDER_QUEUE * 2 * block_bytes);
+  if (p == NULL || blocks == NULL || mem == NULL) {
+    free(p);
+    free(blocks);
+    free(mem);
+    return -1;
+  }
+  p->cfg = cfg;
+  p->in = in;
+  p->out = out;
+  atomic_init(&p->free_q.head, 0);
+  atomic_init(&p->free_q.tail, 0);
+  atomic_init(&p->full_q.head, 0);
+  atomic_init(&p->full_q.tail, 0);
+  atomic_init(&p->done_q.head, 0);
+  atomic_init(&p->done_q.tail, 0);
+  atomic_init(&p->failed, 0);
+  for (int i = 0; i < RENDER_QUEUE; i++) {
+    blocks[i].in = mem + 2 * i * block_bytes;
+    blocks[i].out = mem + (2 * i + 1) * block_bytes;
+    queue_push(p, &p->free_q, &blocks[i]);
+  }
+
+  pthread_t reader, writer;
+  int has_reader = pthread_create(&reader, NULL, reader_main, p) == 0;
+  int has_writer = has_reader && pthread_create(&writer, NULL, writer_main, p) == 0;
+  if (!has_writer) atomic_store(&p->failed, 1);
+
+  t_render_block *b;
+  while (has_writer && (b = queue_pop(p, &p->full_q)) != NULL) {
+    int frames = b->frames;  // b belongs to the writer once pushed
+    if (frames > 0) {
+      int64_t t0 = peqbank_clock_ns();
+      process_block(x, cfg->format, b->in, b->out, frames);
+      result->process_ns += peqbank_clock_ns() - t0;
+      result->frames += frames;
+    }
+    if (!queue_push(p, &p->done_q, b) || frames == 0) break;
+  }
+
+  if (has_reader) pthread_join(reader, NULL);
+  if (has_writer) pthread_join(writer, NULL);
+  int err = atomic_load(&p->failed) ? -1 : 0;
+  result->read_ns = p->read_ns;
+  result->write_ns = p->write_ns;
+  free(p);
+  free(blocks);
+  free(mem);
+  return err;
+}
+// Segment-parallel rendering of a mapped input: the file is cut into one segment per thread, each
+// with its own bank. A segment first runs over the pre-roll before its start, discarding the
+// output, so that its filter state has converged to the serial one within the tolerance by the
+// time its own output begins. Outputs are written in place with pwrite.
+
+typedef struct _render_segment {
+  const t_render_config *cfg;
+  const t_render_input *in;
+  int fd;
+  t_peqbank *x;
+  int64_t preroll_start;  // Frames
+  int64_t start;
+  int64_t end;
+  int64_t process_ns;
+  int err;
+} t_render_segment;
+
+static int write_all(int fd, const char *data, size_t bytes, int64_t offset) {
+  while (bytes > 0) {
+    ssize_t n = pwrite(fd, data, bytes, (off_t)offset);
+    if (n <= 0) return -1;
+    data += n;
+    bytes -= (size_t)n;
+    offset += n;
+  }
+  return 0;
+}
+
+static void *segment_main(void *arg) {
+  t_render_segment *s = (t_render_segment *)arg;
+  int frame_bytes = render_frame_bytes(s->cfg);
+  char *out = (char *)malloc((size_t)s->cfg->block * frame_bytes);
+  if (out == NULL) {
+    s->err = -1;
+    return NULL;
+  }
+
+  int64_t page = sysconf(_SC_PAGESIZE);
+  int64_t released = (s->preroll_start * frame_bytes + page - 1) / page * page;
+  for (int64_t f = s->preroll_start; f < s->end && s->err == 0;) {
+    int64_t stop = f < s->start ? s->start : s->end;
+    int n = (int)min((int64_t)s->cfg->block, stop - f);
+    int64_t t0 = peqbank_clock_ns();
+    process_block(s->x, s->cfg->format, s->in->map + f * frame_bytes, out, n);
+    s->process_ns += peqbank_clock_ns() - t0;
+    if (f >= s->start) s->err = write_all(s->fd, out, (size_t)n * frame_bytes, f * frame_bytes);
+    f += n;
+
+    if (f * frame_bytes - released >= RENDER_RELEASE) {
+      madvise((void *)(s->in->map + released), RENDER_RELEASE, MADV_DONTNEED);
+      released += RENDER_RELEASE;
+    }
+  }
+  free(out);
+  return NULL;
+}
+
+static int render_segmented(const t_render_config *cfg,
+                            t_render_input *in,
+                            FILE *out,
+                            t_peqbank *x,
+                            t_filter **filters,
+                            t_render_result *result) {
+  int frame_bytes = render_frame_bytes(cfg);
+  int64_t frames = in->size / frame_bytes;
+  int preroll = peqbank_decay_length(x, cfg->tolerance);
+  if (preroll < 0) {
+    fprintf(stderr, "Warning: the filters do not decay, rendering serially\n");
+    return render_serial(cfg, in, out, x, result);
+  }
+  // The envelopes of dynamic bands depend on the whole input before them, which no pre-roll
+  // derived from the filter decay reproduces
+  if (x->b_dynamic) {
+    fprintf(stderr, "Warning: dynamic bands cannot be rendered in segments, rendering serially\n");
+    return render_serial(cfg, in, out, x, result);
+  }
+
+  int nseg = min(cfg->segments, RENDER_MAX_SEGMENTS);
+  nseg = (int)max((int64_t)1, min((int64_t)nseg, frames / cfg->block));
+  t_render_segment segs[RENDER_MAX_SEGMENTS];
+  pthread_t tids[RENDER_MAX_SEGMENTS];
+  int started[RENDER_MAX_SEGMENTS];
+  memset(segs, 0, sizeof(segs));
+  for (int i = 0; i < nseg; i++) {
+    t_render_segment *s = &segs[i];
+    s->cfg = cfg;
+    s->in = in;
+    s->fd = fileno(out);
+    s->start = frames * i / nseg;
+    s->end = frames * (i + 1) / nseg;
+    s->preroll_start = max((int64_t)0, s->start - preroll);
+    if (i == 0) {
+      s->x = x;
+    } else if ((s->x = peqbank_new(cfg->sampling_rate, cfg->channels, cfg->block)) != NULL) {
+      s->x->b_mode = FAST;
+      peqbank_setup(s->x, filters);
+    } else {
+      s->err = -1;
+    }
+  }
+
+  for (int i = 1; i < nseg; i++) {
+    started[i] = segs[i].x && pthread_create(&tids[i], NULL, segment_main, &segs[i]) == 0;
+  }
+  segment_main(&segs[0]);
+  for (int i = 1; i < nseg; i++) {
+    if (started[i]) {
+      pthread_join(tids[i], NULL);
+    } else if (segs[i].x) {
+      segment_main(&segs[i]);  // no thread left, render it here
+    }
+  }
+
+  int err = 0;
+  for (int i = 0; i < nseg; i++) {
+    err |= segs[i].err;
+    result->process_ns += segs[i].process_ns;
+    if (i > 0 && segs[i].x) {
+      segs[i].x->filters = NULL;
+      peqbank_free(segs[i].x);
+    }
+  }
+  result->frames = frames;
+  result->preroll = preroll;
+  result->segments = nseg;
+  if (in->size % frame_bytes) {
+    fprintf(stderr, "Warning: ignoring a trailing partial frame in %s\n", cfg->in_path);
+  }
+  return err ? -1 : 0;
+}
+#endif
+
+int render_file_bank(const t_render_config *cfg, t_peqbank *x, t_render_result *result) {
+  size_t block_bytes = (size_t)cfg->block * render_frame_bytes(cfg);
+  int64_t start = peqbank_clock_ns();
+  memset(result, 0, sizeof(*result));
+
+  t_filter **filters = new_filters_from_spec(cfg->filters);
+  if (filters == NULL) {
+    fprintf(stderr, "Invalid filter spec: %s\n", cfg->filters);
+    return -1;
+  }
+
+  t_render_input in;
+  if (input_open(&in, cfg->in_path, block_bytes) != 0) {
+    fprintf(stderr, "Cannot open %s\n", cfg->in_path);
+    free_filters(filters);
+    free(filters);
+    return -1;
+  }
+  FILE *out = fopen(cfg->out_path, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Cannot create %s\n", cfg->out_path);
+    input_close(&in);
+    free_filters(filters);
+    free(filters);
+    return -1;
+  }
+  setvbuf(out, NULL, _IOFBF, RENDER_OUT_BUFFER);
+
+  // No ramp from the zeroed coefficients: the filters apply from the first sample
+  x->b_mode = FAST;
+  peqbank_setup(x, filters);
+
+  int err;
+#ifndef _WIN32
+  if (cfg->segments > 1 && in.map) {
+    err = render_segmented(cfg, &in, out, x, filters, result);
+  } else if (cfg->pipeline) {
+    err = render_pipelined(cfg, &in, out, x, result);
+  } else {
+    err = render_serial(cfg, &in, out, x, result);
+  }
+#else
+  err = render_serial(cfg, &in, out, x, result);
+#endif
+  x->s_n = cfg->block;
+  x->filters = NULL;
+  if (fclose(out) != 0) err = -1;
+  result->ns = peqbank_clock_ns() - start;
+
+  input_close(&in);
+  free_filters(filters);
+  free(filters);
+  return err;
+}
+
+int render_file(const t_render_config *cfg, t_render_result *result) {
+  t_peqbank *x = peqbank_new(cfg->sampling_rate, cfg->channels, cfg->block);
+  if (x == NULL) return -1;
+  int err = render_file_bank(cfg, x, result);
+  peqbank_free(x);
+  return err;
+}
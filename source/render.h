@@ -0,0 +1,65 @@
+// Copyright (c) 2020 Spotify AB.
+//
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef render_h
+#define render_h
+
+#include "PeqBank/peqbank.h"
+
+#define RENDER_BLOCK 4096        // Default frames per callback
+#define RENDER_TOLERANCE 1e-6f  // Default segment tolerance, about -120 dBFS
+
+enum { RENDER_S16, RENDER_F32 };
+
+// Raw interleaved PCM in native byte order, described on the command line
+typedef struct _render_config {
+  const char *in_path;
+  const char *out_path;
+  const char *filters;  // Filter spec, see new_filters_from_spec
+  int format;           // RENDER_S16 or RENDER_F32, for both input and output
+  int sampling_rate;
+  int channels;
+  int block;        // Frames per callback
+  int pipeline;     // Read, process and write on separate threads (serial on Windows)
+  int segments;     // Render this many segments of the file in parallel (serial on Windows)
+  float tolerance;  // Max deviation of segmented output from serial output, relative to full scale
+} t_render_config;
+
+typedef struct _render_result {
+  int64_t frames;      // Frames rendered
+  int64_t ns;          // Wall-clock time, including file I/O
+  int64_t read_ns;     // Time spent reading input (pipelined mode only)
+  int64_t process_ns;  // Time spent in the callbacks
+  int64_t write_ns;    // Time spent writing output
+  int preroll;         // Pre-roll frames per segment (segmented mode only)
+  int segments;        // Segments rendered in parallel
+} t_render_result;
+
+int render_parse_format(const char *name);
+int render_frame_bytes(const t_render_config *cfg);
+
+// Streams in_path through a bank built from cfg->filters into out_path, one block at a time, so
+// memory use does not depend on the file length. Returns 0 on success, -1 on error.
+int render_file(const t_render_config *cfg, t_render_result *result);
+
+// Same, with a bank created for cfg's sampling rate, channel count and block size. The bank is set
+// up from scratch, so it can be reused for another file afterwards.
+int render_file_bank(const t_render_config *cfg, t_peqbank *x, t_render_result *result);
+
+#endif /* render_h */